@@ -0,0 +1,223 @@
+/* arena - region/bump memory allocator
+ * author: John Tsiombikas <nuclear@member.fsf.org>
+ * license: public domain
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ALIGN			16
+#define ALIGN_UP(x)		(((x) + ALIGN - 1) & ~(size_t)(ALIGN - 1))
+
+#define DEF_BLOCK_SIZE	65536
+
+/* blocks are chained from the newest to the oldest, and allocations are only
+ * made from the newest one.
+ */
+struct arena_block {
+	struct arena_block *prev;
+	size_t size, used;	/* size of the data area, and bytes allocated from it */
+};
+
+#define BLK_HDR			ALIGN_UP(sizeof(struct arena_block))
+#define BLK_DATA(b)		((char*)(b) + BLK_HDR)
+
+struct arena {
+	struct arena_block *cur;
+	struct arena_block *spare;	/* a released block, kept for reuse */
+	size_t block_size;
+	struct mem_allocator ator;
+};
+
+static void *ator_alloc(size_t sz, void *cls);
+static void *ator_realloc(void *p, size_t oldsz, size_t newsz, void *cls);
+static void ator_free(void *p, size_t sz, void *cls);
+
+static struct arena_block *new_block(struct arena *ar, size_t sz)
+{
+	struct arena_block *b;
+	size_t size = sz > ar->block_size ? sz : ar->block_size;
+
+	if(ar->spare && ar->spare->size >= size) {
+		b = ar->spare;
+		ar->spare = 0;
+	} else {
+		if(!(b = malloc(BLK_HDR + size))) {
+			return 0;
+		}
+		b->size = size;
+	}
+	b->used = 0;
+	b->prev = ar->cur;
+	ar->cur = b;
+	return b;
+}
+
+static void release_block(struct arena *ar, struct arena_block *b)
+{
+	if(!ar->spare && b->size == ar->block_size) {
+		ar->spare = b;
+	} else {
+		free(b);
+	}
+}
+
+/* is p the last allocation made from the arena? */
+static int is_last(struct arena *ar, void *p, size_t sz)
+{
+	return (char*)p + ALIGN_UP(sz) == BLK_DATA(ar->cur) + ar->cur->used;
+}
+
+struct arena *arena_create(size_t block_size)
+{
+	struct arena *ar;
+
+	if(!(ar = malloc(sizeof *ar))) {
+		return 0;
+	}
+	ar->cur = ar->spare = 0;
+	ar->block_size = block_size ? ALIGN_UP(block_size) : DEF_BLOCK_SIZE;
+
+	ar->ator.alloc = ator_alloc;
+	ar->ator.realloc = ator_realloc;
+	ar->ator.free = ator_free;
+	ar->ator.cls = ar;
+
+	if(!new_block(ar, 0)) {
+		free(ar);
+		return 0;
+	}
+	return ar;
+}
+
+void arena_destroy(struct arena *ar)
+{
+	struct arena_block *b;
+
+	if(!ar) return;
+
+	while(ar->cur) {
+		b = ar->cur;
+		ar->cur = b->prev;
+		free(b);
+	}
+	free(ar->spare);
+	free(ar);
+}
+
+void *arena_alloc(struct arena *ar, size_t sz)
+{
+	void *p;
+
+	if(!sz) sz = 1;
+	if(sz > (size_t)-1 - ALIGN - BLK_HDR) {
+		return 0;
+	}
+	sz = ALIGN_UP(sz);
+
+	if(ar->cur->used + sz > ar->cur->size) {
+		if(!new_block(ar, sz)) {
+			return 0;
+		}
+	}
+
+	p = BLK_DATA(ar->cur) + ar->cur->used;
+	ar->cur->used += sz;
+	return p;
+}
+
+void *arena_realloc(struct arena *ar, void *p, size_t oldsz, size_t newsz)
+{
+	void *newp;
+
+	if(!p) {
+		return arena_alloc(ar, newsz);
+	}
+
+	if(is_last(ar, p, oldsz)) {
+		size_t start = (char*)p - BLK_DATA(ar->cur);
+		if(newsz <= ar->cur->size - start) {
+			ar->cur->used = start + ALIGN_UP(newsz ? newsz : 1);
+			return p;
+		}
+	} else if(newsz <= oldsz) {
+		return p;
+	}
+
+	if(!(newp = arena_alloc(ar, newsz))) {
+		return 0;
+	}
+	memcpy(newp, p, oldsz < newsz ? oldsz : newsz);
+	return newp;
+}
+
+void arena_free(struct arena *ar, void *p, size_t sz)
+{
+	if(p && is_last(ar, p, sz)) {
+		ar->cur->used -= ALIGN_UP(sz ? sz : 1);
+	}
+}
+
+struct arena_mark arena_save(struct arena *ar)
+{
+	struct arena_mark mark;
+	mark.blk = ar->cur;
+	mark.used = ar->cur->used;
+	return mark;
+}
+
+void arena_restore(struct arena *ar, struct arena_mark mark)
+{
+	struct arena_block *b;
+
+	while(ar->cur != mark.blk && ar->cur->prev) {
+		b = ar->cur;
+		ar->cur = b->prev;
+		release_block(ar, b);
+	}
+	ar->cur->used = mark.used;
+}
+
+void arena_reset(struct arena *ar)
+{
+	struct arena_mark mark;
+
+	mark.blk = ar->cur;
+	while(((struct arena_block*)mark.blk)->prev) {
+		mark.blk = ((struct arena_block*)mark.blk)->prev;
+	}
+	mark.used = 0;
+	arena_restore(ar, mark);
+}
+
+size_t arena_used(struct arena *ar)
+{
+	size_t sum = 0;
+	struct arena_block *b = ar->cur;
+
+	while(b) {
+		sum += b->used;
+		b = b->prev;
+	}
+	return sum;
+}
+
+struct mem_allocator *arena_allocator(struct arena *ar)
+{
+	return &ar->ator;
+}
+
+static void *ator_alloc(size_t sz, void *cls)
+{
+	return arena_alloc(cls, sz);
+}
+
+static void *ator_realloc(void *p, size_t oldsz, size_t newsz, void *cls)
+{
+	return arena_realloc(cls, p, oldsz, newsz);
+}
+
+static void ator_free(void *p, size_t sz, void *cls)
+{
+	arena_free(cls, p, sz);
+}
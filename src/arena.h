@@ -0,0 +1,80 @@
+/* arena - region/bump memory allocator
+ * author: John Tsiombikas <nuclear@member.fsf.org>
+ * license: public domain
+ */
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/* Generic allocator interface, for modules which can be told where to get
+ * their memory from (see dynarr_alloc_ator and cmesh_set_allocator). Every
+ * call gets the size of the block being reallocated or freed, so that
+ * allocators don't have to keep track of it. A null allocator handle means
+ * malloc/realloc/free.
+ */
+struct mem_allocator {
+	void *(*alloc)(size_t sz, void *cls);
+	void *(*realloc)(void *p, size_t oldsz, size_t newsz, void *cls);
+	void (*free)(void *p, size_t sz, void *cls);
+	void *cls;
+};
+
+/* An arena hands out memory by bumping a pointer through large blocks, and
+ * releases all of it at once with arena_reset or arena_destroy, instead of
+ * freeing each allocation. Allocations are aligned to 16 bytes.
+ * Arenas are not thread-safe: use one per thread.
+ *
+ * Arenas suit data which is allocated once, at its final size. Only the last
+ * allocation can grow in place, and only within its block; growing anything
+ * else copies it, and the old copy stays dead in the arena until it's reset.
+ * An array which keeps growing in an arena uses several times the memory it
+ * would with realloc.
+ *
+ * usage example:
+ * -------------
+ * struct arena *ar = arena_create(0);
+ *
+ * struct arena_mark mark = arena_save(ar);
+ * ... allocate temporary data with arena_alloc ...
+ * arena_restore(ar, mark);	(releases everything allocated since arena_save)
+ *
+ * arena_destroy(ar);
+ */
+struct arena;
+
+struct arena_mark {
+	void *blk;
+	size_t used;
+};
+
+/* block_size is the size of each block of memory requested from malloc, 0 for
+ * the default (64k). Allocations larger than that get a block of their own.
+ */
+struct arena *arena_create(size_t block_size);
+void arena_destroy(struct arena *ar);
+
+void *arena_alloc(struct arena *ar, size_t sz);
+/* Resizes in place if p is the last allocation and there's room, otherwise
+ * makes a new allocation and copies the data; the old one is only reclaimed
+ * when the arena is reset.
+ */
+void *arena_realloc(struct arena *ar, void *p, size_t oldsz, size_t newsz);
+/* only reclaims the memory if p is the last allocation */
+void arena_free(struct arena *ar, void *p, size_t sz);
+
+/* scoped reset: arena_restore releases everything allocated after the
+ * corresponding arena_save. Marks must be restored in reverse order.
+ */
+struct arena_mark arena_save(struct arena *ar);
+void arena_restore(struct arena *ar, struct arena_mark mark);
+/* releases every allocation, keeping one block for reuse */
+void arena_reset(struct arena *ar);
+
+/* returns the number of bytes currently allocated from the arena */
+size_t arena_used(struct arena *ar);
+
+/* returns an allocator handle which allocates from the arena */
+struct mem_allocator *arena_allocator(struct arena *ar);
+
+#endif	/* ARENA_H_ */
@@ -0,0 +1,344 @@
+/* thread pool benchmark suite: runs the same scenarios on tpool (FIFO and
+ * work-stealing modes) and ThreadPool, and prints a table, plus optionally
+ * the same results in JSON, for comparing schedulers and catching
+ * regressions.
+ * author: John Tsiombikas <nuclear@member.fsf.org>
+ * This code is public domain.
+ *
+ * Build from the src directory with:
+ *   cc -O2 -c tpool.c
+ *   c++ -std=c++11 -O2 -o poolbench bench/poolbench.cc threadpool.cc tpool.o -I. -lpthread
+ *
+ * usage: poolbench [-t threads] [-n jobs] [-j file.json]
+ * -j writes the results in JSON as well, to stdout if the file name is "-",
+ * in which case everything else goes to stderr.
+ *
+ * Benchmarks:
+ *  - enqueue-1p: empty jobs queued by a single producer, until all are done
+ *  - enqueue-np: the same jobs spread over one producer per worker
+ *  - wake-p50/p99: latency from enqueue to job start, on an idle pool
+ *  - fanout: a batch of empty jobs queued and waited on, per batch
+ *  - cost-N: jobs spinning for N usec; efficiency against perfect scaling
+ *  - wait-empty: wait on a pool with nothing to do
+ *  - roundtrip: a single empty job queued and waited on
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "tpool.h"
+#include "threadpool.h"
+
+using namespace std::chrono;
+
+typedef void (*job_func)(void*);
+
+// common interface over the pools under test
+class Pool {
+public:
+	virtual ~Pool() {}
+	virtual const char *name() const = 0;
+	virtual void enqueue(job_func func, void *arg) = 0;
+	virtual void wait() = 0;
+};
+
+class TPool : public Pool {
+private:
+	struct thread_pool *tpool;
+	const char *pname;
+
+public:
+	TPool(int nthreads, unsigned int flags, const char *pname)
+	{
+		if(!(tpool = tpool_create_flags(nthreads, flags))) {
+			fprintf(stderr, "failed to create thread pool: %s\n", pname);
+			abort();
+		}
+		this->pname = pname;
+	}
+	~TPool() { tpool_destroy(tpool); }
+
+	const char *name() const { return pname; }
+	void enqueue(job_func func, void *arg) { tpool_enqueue(tpool, arg, func, 0); }
+	void wait() { tpool_wait(tpool); }
+};
+
+class CxxPool : public Pool {
+private:
+	ThreadPool pool;
+
+public:
+	explicit CxxPool(int nthreads) : pool(nthreads) {}
+
+	const char *name() const { return "ThreadPool"; }
+	void enqueue(job_func func, void *arg) { pool.add_work([func, arg]() { func(arg); }); }
+	void wait() { pool.wait(); }
+};
+
+struct Result {
+	std::string bench, unit;
+	std::vector<double> val;	// one per pool
+};
+
+static int nthreads, njobs;
+static std::vector<Result> results;
+static const char *pool_names[3];
+
+static inline unsigned long long usec_now()
+{
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static inline double sec_since(steady_clock::time_point t0)
+{
+	return duration<double>(steady_clock::now() - t0).count();
+}
+
+static void add_result(int pidx, const char *bench, const char *unit, double val)
+{
+	for(Result &r : results) {
+		if(r.bench == bench) {
+			r.val[pidx] = val;
+			return;
+		}
+	}
+	Result r;
+	r.bench = bench;
+	r.unit = unit;
+	r.val.assign(3, 0.0);
+	r.val[pidx] = val;
+	results.push_back(r);
+}
+
+static void empty_job(void *arg)
+{
+	(void)arg;
+}
+
+static void spin_job(void *arg)
+{
+	unsigned long long t0 = usec_now();
+	unsigned long long cost = (unsigned long long)(size_t)arg;
+	while(usec_now() - t0 < cost);
+}
+
+static void bench_enqueue(int pidx, Pool *pool)
+{
+	steady_clock::time_point t0 = steady_clock::now();
+	for(int i=0; i<njobs; i++) {
+		pool->enqueue(empty_job, 0);
+	}
+	pool->wait();
+	add_result(pidx, "enqueue-1p", "Mjobs/s", njobs / sec_since(t0) * 1e-6);
+
+	std::vector<std::thread> prod;
+	int per_prod = njobs / nthreads;
+
+	t0 = steady_clock::now();
+	for(int i=0; i<nthreads; i++) {
+		prod.push_back(std::thread([pool, per_prod]() {
+			for(int j=0; j<per_prod; j++) {
+				pool->enqueue(empty_job, 0);
+			}
+		}));
+	}
+	for(std::thread &t : prod) {
+		t.join();
+	}
+	pool->wait();
+	add_result(pidx, "enqueue-np", "Mjobs/s", per_prod * nthreads / sec_since(t0) * 1e-6);
+}
+
+struct wake_job {
+	unsigned long long tenq, tstart;
+};
+
+static void wake_func(void *arg)
+{
+	((wake_job*)arg)->tstart = usec_now();
+}
+
+static void bench_wake(int pidx, Pool *pool)
+{
+	std::vector<unsigned long long> lat;
+	wake_job job;
+
+	for(int i=0; i<200; i++) {
+		// long enough for every worker to stop spinning and go to sleep
+		std::this_thread::sleep_for(milliseconds(2));
+		job.tenq = usec_now();
+		pool->enqueue(wake_func, &job);
+		pool->wait();
+		lat.push_back(job.tstart - job.tenq);
+	}
+	std::sort(lat.begin(), lat.end());
+	add_result(pidx, "wake-p50", "usec", (double)lat[lat.size() / 2]);
+	add_result(pidx, "wake-p99", "usec", (double)lat[lat.size() * 99 / 100]);
+}
+
+static void bench_fanout(int pidx, Pool *pool)
+{
+	int batch = 1000;
+	int rounds = std::max(njobs / batch, 10);
+
+	steady_clock::time_point t0 = steady_clock::now();
+	for(int i=0; i<rounds; i++) {
+		for(int j=0; j<batch; j++) {
+			pool->enqueue(empty_job, 0);
+		}
+		pool->wait();
+	}
+	add_result(pidx, "fanout-1000", "usec", sec_since(t0) * 1e6 / rounds);
+}
+
+static void bench_cost(int pidx, Pool *pool)
+{
+	static const int costs[] = {1, 10, 100, 1000};
+	char name[32];
+
+	for(int i=0; i<4; i++) {
+		// about 0.2 sec of work per thread
+		int n = nthreads * 200000 / costs[i];
+
+		steady_clock::time_point t0 = steady_clock::now();
+		for(int j=0; j<n; j++) {
+			pool->enqueue(spin_job, (void*)(size_t)costs[i]);
+		}
+		pool->wait();
+		double ideal = (double)n * costs[i] * 1e-6 / nthreads;
+
+		sprintf(name, "cost-%dus", costs[i]);
+		add_result(pidx, name, "% eff", 100.0 * ideal / sec_since(t0));
+	}
+}
+
+static void bench_wait(int pidx, Pool *pool)
+{
+	int n = 100000;
+
+	steady_clock::time_point t0 = steady_clock::now();
+	for(int i=0; i<n; i++) {
+		pool->wait();
+	}
+	add_result(pidx, "wait-empty", "nsec", sec_since(t0) * 1e9 / n);
+
+	n = 10000;
+	t0 = steady_clock::now();
+	for(int i=0; i<n; i++) {
+		pool->enqueue(empty_job, 0);
+		pool->wait();
+	}
+	add_result(pidx, "roundtrip", "usec", sec_since(t0) * 1e6 / n);
+}
+
+static void write_json(FILE *fp)
+{
+	fprintf(fp, "{\n  \"threads\": %d,\n  \"jobs\": %d,\n  \"results\": [\n", nthreads, njobs);
+	for(size_t i=0; i<results.size(); i++) {
+		const Result &r = results[i];
+		fprintf(fp, "    {\"bench\": \"%s\", \"unit\": \"%s\"", r.bench.c_str(), r.unit.c_str());
+		for(int j=0; j<3; j++) {
+			fprintf(fp, ", \"%s\": %g", pool_names[j], r.val[j]);
+		}
+		fprintf(fp, "}%s\n", i < results.size() - 1 ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+}
+
+static void run_benchmarks(int pidx, Pool *pool)
+{
+	pool_names[pidx] = pool->name();
+
+	fprintf(stderr, "%s ...\n", pool->name());
+	bench_enqueue(pidx, pool);
+	bench_wake(pidx, pool);
+	bench_fanout(pidx, pool);
+	bench_cost(pidx, pool);
+	bench_wait(pidx, pool);
+}
+
+int main(int argc, char **argv)
+{
+	const char *json_fname = 0;
+	FILE *json_fp = 0;
+
+	nthreads = tpool_num_processors();
+	njobs = 1000000;
+
+	for(int i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-t") == 0 && i < argc - 1) {
+			nthreads = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-n") == 0 && i < argc - 1) {
+			njobs = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-j") == 0 && i < argc - 1) {
+			json_fname = argv[++i];
+		} else {
+			fprintf(stderr, "usage: %s [-t threads] [-n jobs] [-j file.json]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(nthreads <= 0 || njobs <= 0) {
+		fprintf(stderr, "invalid number of threads or jobs\n");
+		return 1;
+	}
+
+	if(json_fname) {
+		if(strcmp(json_fname, "-") == 0) {
+			// keep stdout for the JSON alone: anything else printed to it,
+			// the table and the pools' own messages included, goes to stderr
+			fflush(stdout);
+			int fd = dup(1);
+			if(fd == -1 || !(json_fp = fdopen(fd, "w")) || dup2(2, 1) == -1) {
+				perror("failed to redirect stdout");
+				return 1;
+			}
+		} else if(!(json_fp = fopen(json_fname, "w"))) {
+			perror("failed to open json output file");
+			return 1;
+		}
+	}
+
+	// constructed on the stack, since ThreadPool is over-aligned
+	{
+		TPool pool(nthreads, 0, "tpool");
+		run_benchmarks(0, &pool);
+	}
+	{
+		TPool pool(nthreads, TPOOL_WORK_STEALING, "tpool-ws");
+		run_benchmarks(1, &pool);
+	}
+	{
+		CxxPool pool(nthreads);
+		run_benchmarks(2, &pool);
+	}
+
+	printf("\n%d threads, %d jobs\n", nthreads, njobs);
+	printf("%-14s %-8s", "benchmark", "unit");
+	for(int i=0; i<3; i++) {
+		printf(" %12s", pool_names[i]);
+	}
+	putchar('\n');
+	for(const Result &r : results) {
+		printf("%-14s %-8s", r.bench.c_str(), r.unit.c_str());
+		for(int i=0; i<3; i++) {
+			printf(" %12.2f", r.val[i]);
+		}
+		putchar('\n');
+	}
+
+	if(json_fp) {
+		write_json(json_fp);
+		fclose(json_fp);
+	}
+	return 0;
+}
@@ -0,0 +1,264 @@
+/* tpool NUMA benchmark: memory-bound jobs whose data lives on a particular
+ * NUMA node, with and without NUMA-aware job placement, in both scheduling
+ * modes.
+ * author: John Tsiombikas <nuclear@member.fsf.org>
+ * This code is public domain.
+ *
+ * Linux only. Build from the src directory with:
+ *   cc -O2 -o tpool_numa bench/tpool_numa.c tpool.c -I. -lpthread
+ *
+ * Before timing anything, every job buffer is allocated and first-touched by
+ * a thread pinned to one of the NUMA nodes, so its pages land on that node.
+ * Each run then starts one producer per node, pinned to the same node, which
+ * enqueues the jobs whose data lives there. Jobs stream through their buffer a
+ * number of times. With pinned workers in work-stealing mode, jobs enqueued
+ * from a node go to the workers on that node, and read local memory; in the
+ * other configurations they run wherever, and often read across nodes. The
+ * difference only shows on multi-socket machines, and is most pronounced when
+ * the pool has a thread per core.
+ */
+#ifndef __linux__
+#error "this benchmark is Linux-only"
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include "tpool.h"
+
+struct job {
+	unsigned long *buf;
+	size_t count;
+	int passes;
+	unsigned long sum;
+};
+
+/* jobs whose data lives on a node, and a CPU of that node to run their
+ * producer on.
+ */
+struct node {
+	int cpu;
+	int njobs;
+	void **jobs;
+	struct thread_pool *tpool;	/* pool to enqueue to, during runs */
+};
+
+static void work(void *cls)
+{
+	int i;
+	size_t j;
+	unsigned long sum = 0;
+	struct job *job = cls;
+
+	for(i=0; i<job->passes; i++) {
+		for(j=0; j<job->count; j++) {
+			sum += job->buf[j];
+		}
+	}
+	job->sum = sum;
+}
+
+static double get_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static int cpu_numa_node(int cpu)
+{
+	int node = -1;
+	char path[64];
+	DIR *dir;
+	struct dirent *ent;
+
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	if(!(dir = opendir(path))) {
+		return -1;
+	}
+	while((ent = readdir(dir))) {
+		if(sscanf(ent->d_name, "node%d", &node) == 1) {
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+/* finds the first allowed CPU of each NUMA node, returns the number of nodes */
+static int find_nodes(struct node *nodes, int max_nodes)
+{
+	int i, j, n, nnodes = 0;
+	cpu_set_t set;
+
+	if(sched_getaffinity(0, sizeof set, &set) == -1) {
+		CPU_ZERO(&set);
+		CPU_SET(0, &set);
+	}
+	for(i=0; i<CPU_SETSIZE; i++) {
+		if(!CPU_ISSET(i, &set)) continue;
+		if((n = cpu_numa_node(i)) < 0) n = 0;
+
+		for(j=0; j<nnodes; j++) {
+			if(cpu_numa_node(nodes[j].cpu) == n) break;
+		}
+		if(j == nnodes && nnodes < max_nodes) {
+			nodes[nnodes++].cpu = i;
+		}
+	}
+	if(!nnodes) {
+		nodes[0].cpu = 0;
+		nnodes = 1;
+	}
+	return nnodes;
+}
+
+static void pin_self(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+}
+
+/* allocates and first-touches the buffers of a node's jobs, on that node */
+static void *touch_func(void *arg)
+{
+	int i;
+	size_t j;
+	struct node *nd = arg;
+
+	pin_self(nd->cpu);
+	for(i=0; i<nd->njobs; i++) {
+		struct job *job = nd->jobs[i];
+		if(!(job->buf = malloc(job->count * sizeof *job->buf))) {
+			fprintf(stderr, "failed to allocate job buffer\n");
+			exit(1);
+		}
+		for(j=0; j<job->count; j++) {
+			job->buf[j] = j;
+		}
+	}
+	return 0;
+}
+
+/* enqueues a node's jobs from that node */
+static void *producer_func(void *arg)
+{
+	struct node *nd = arg;
+
+	pin_self(nd->cpu);
+	tpool_enqueue_many(nd->tpool, nd->njobs, nd->jobs, work, 0);
+	return 0;
+}
+
+static void run_on_nodes(struct node *nodes, int nnodes, void *(*func)(void*))
+{
+	int i;
+	pthread_t thr[64];
+
+	for(i=0; i<nnodes; i++) {
+		if(pthread_create(thr + i, 0, func, nodes + i) != 0) {
+			fprintf(stderr, "failed to start thread\n");
+			exit(1);
+		}
+	}
+	for(i=0; i<nnodes; i++) {
+		pthread_join(thr[i], 0);
+	}
+}
+
+static double run(unsigned int flags, int nthreads, struct node *nodes, int nnodes)
+{
+	int i;
+	double t0, t;
+	struct thread_pool *tpool;
+
+	if(!(tpool = tpool_create_flags(nthreads, flags))) {
+		fprintf(stderr, "failed to create thread pool\n");
+		exit(1);
+	}
+	for(i=0; i<nnodes; i++) {
+		nodes[i].tpool = tpool;
+	}
+
+	t0 = get_sec();
+	run_on_nodes(nodes, nnodes, producer_func);
+	tpool_wait(tpool);
+	t = get_sec() - t0;
+
+	tpool_destroy(tpool);
+	return t;
+}
+
+int main(int argc, char **argv)
+{
+	int i, nthreads = 0, njobs = 0, passes = 8, size_mb = 64, nnodes;
+	struct job *jobs;
+	struct node nodes[64];
+	double t, gb;
+	static const struct {
+		const char *name;
+		unsigned int flags;
+	} cfg[] = {
+		{"fifo", 0},
+		{"fifo, pinned", TPOOL_PIN_THREADS},
+		{"work-stealing", TPOOL_WORK_STEALING},
+		{"work-stealing, pinned", TPOOL_WORK_STEALING | TPOOL_PIN_THREADS}
+	};
+
+	for(i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-t") == 0 && argv[i + 1]) {
+			nthreads = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-j") == 0 && argv[i + 1]) {
+			njobs = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-s") == 0 && argv[i + 1]) {
+			size_mb = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-p") == 0 && argv[i + 1]) {
+			passes = atoi(argv[++i]);
+		} else {
+			printf("usage: %s [-t threads] [-j jobs] [-s MB per job] [-p passes]\n", argv[0]);
+			return strcmp(argv[i], "-h") == 0 ? 0 : 1;
+		}
+	}
+	if(nthreads <= 0) nthreads = tpool_num_processors();
+	if(njobs <= 0) njobs = nthreads * 4;
+
+	nnodes = find_nodes(nodes, sizeof nodes / sizeof *nodes);
+
+	/* deal the jobs out to the nodes round-robin */
+	jobs = calloc(njobs, sizeof *jobs);
+	for(i=0; i<nnodes; i++) {
+		nodes[i].njobs = 0;
+		nodes[i].jobs = malloc(njobs * sizeof *nodes[i].jobs);
+	}
+	for(i=0; i<njobs; i++) {
+		struct node *nd = nodes + i % nnodes;
+		jobs[i].count = ((size_t)size_mb << 20) / sizeof *jobs[i].buf;
+		jobs[i].passes = passes;
+		nd->jobs[nd->njobs++] = jobs + i;
+	}
+	run_on_nodes(nodes, nnodes, touch_func);
+	gb = (double)njobs * passes * size_mb / 1024.0;
+
+	printf("%d threads, %d NUMA nodes, %d jobs of %d MB, %d passes\n", nthreads,
+			nnodes, njobs, size_mb, passes);
+	for(i=0; i<(int)(sizeof cfg / sizeof *cfg); i++) {
+		t = run(cfg[i].flags, nthreads, nodes, nnodes);
+		printf("%-24s %8.3f sec  %8.2f GB/s\n", cfg[i].name, t, gb / t);
+	}
+
+	for(i=0; i<njobs; i++) {
+		free(jobs[i].buf);
+	}
+	for(i=0; i<nnodes; i++) {
+		free(nodes[i].jobs);
+	}
+	free(jobs);
+	return 0;
+}
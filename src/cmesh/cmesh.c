@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <limits.h>
 #include <float.h>
@@ -10,12 +11,14 @@
 #include "opengl.h"
 #endif
 #include "cmesh.h"
+#include "arena.h"
 
 
 struct cmesh_vattrib {
 	int nelem;	/* num elements per attribute [1, 4] */
 	float *data;
 	unsigned int count;	/* number of floats in data */
+	unsigned int cap;	/* number of floats allocated */
 #ifdef USE_VBO
 	unsigned int vbo;
 	int vbo_valid;
@@ -50,7 +53,7 @@ struct cmesh {
 	struct cmesh_vattrib vattr[CMESH_NUM_ATTR];
 
 	unsigned int *idata;
-	unsigned int icount;
+	unsigned int icount, icap;
 #ifdef USE_VBO
 	unsigned int ibo;
 	int ibo_valid;
@@ -73,6 +76,8 @@ struct cmesh {
 	cgm_vec3 bsph_center;
 	float bsph_radius;
 	int bsph_valid;
+
+	struct mem_allocator *ator;	/* null for malloc */
 };
 
 
@@ -88,6 +93,55 @@ static void calc_bsph(struct cmesh *cm);
 
 static int def_nelem[CMESH_NUM_ATTR] = {3, 3, 3, 2, 4, 4, 4, 2};
 
+/* initial capacity of arrays grown by the push functions */
+#define MIN_PUSH_CAP	64
+
+/* memory management of everything owned by the mesh goes through these */
+static void *cm_alloc(const struct cmesh *cm, size_t sz)
+{
+	if(cm->ator) {
+		return cm->ator->alloc(sz, cm->ator->cls);
+	}
+	return malloc(sz);
+}
+
+static void *cm_realloc(const struct cmesh *cm, void *p, size_t oldsz, size_t newsz)
+{
+	if(cm->ator) {
+		return cm->ator->realloc(p, oldsz, newsz, cm->ator->cls);
+	}
+	return realloc(p, newsz);
+}
+
+static void cm_free(const struct cmesh *cm, void *p, size_t sz)
+{
+	if(!p) return;
+
+	if(cm->ator) {
+		cm->ator->free(p, sz, cm->ator->cls);
+	} else {
+		free(p);
+	}
+}
+
+static char *cm_strdup(const struct cmesh *cm, const char *s)
+{
+	char *str;
+	size_t len = strlen(s);
+
+	if((str = cm_alloc(cm, len + 1))) {
+		memcpy(str, s, len + 1);
+	}
+	return str;
+}
+
+static void cm_free_str(const struct cmesh *cm, char *s)
+{
+	if(s) {
+		cm_free(cm, s, strlen(s) + 1);
+	}
+}
+
 #ifdef USE_SDR
 static int sdr_loc[CMESH_NUM_ATTR] = {0, 1, 2, 3, 4, 5, 6, 7};
 static int use_custom_sdr_attr;
@@ -155,16 +209,21 @@ int cmesh_init(struct cmesh *cm)
 	return 0;
 }
 
+void cmesh_set_allocator(struct cmesh *cm, struct mem_allocator *ator)
+{
+	cm->ator = ator;
+}
+
 void cmesh_destroy(struct cmesh *cm)
 {
 	int i;
 
-	free(cm->name);
+	cm_free_str(cm, cm->name);
 
 	for(i=0; i<CMESH_NUM_ATTR; i++) {
-		free(cm->vattr[i].data);
+		cm_free(cm, cm->vattr[i].data, cm->vattr[i].cap * sizeof(float));
 	}
-	free(cm->idata);
+	cm_free(cm, cm->idata, cm->icap * sizeof *cm->idata);
 
 	cmesh_clear_submeshes(cm);
 
@@ -191,17 +250,17 @@ void cmesh_clear(struct cmesh *cm)
 		cm->vattr[i].vbo_valid = 0;
 		cm->vattr[i].data_valid = 0;
 #endif
-		free(cm->vattr[i].data);
+		cm_free(cm, cm->vattr[i].data, cm->vattr[i].cap * sizeof(float));
 		cm->vattr[i].data = 0;
-		cm->vattr[i].count = 0;
+		cm->vattr[i].count = cm->vattr[i].cap = 0;
 	}
 #ifdef USE_VBO
 	cm->ibo_valid = 0;
 #endif
 	cm->idata_valid = 0;
-	free(cm->idata);
+	cm_free(cm, cm->idata, cm->icap * sizeof *cm->idata);
 	cm->idata = 0;
-	cm->icount = 0;
+	cm->icount = cm->icap = 0;
 
 #ifdef USE_VBO
 	cm->wire_ibo_valid = 0;
@@ -238,10 +297,9 @@ static int clone(struct cmesh *cmdest, const struct cmesh *cmsrc, struct submesh
 
 	srcname = sub ? sub->name : cmsrc->name;
 	if(srcname) {
-		if(!(name = malloc(strlen(srcname) + 1))) {
+		if(!(name = cm_strdup(cmdest, srcname))) {
 			return -1;
 		}
-		strcpy(name, srcname);
 	}
 
 	if(sub) {
@@ -256,8 +314,8 @@ static int clone(struct cmesh *cmdest, const struct cmesh *cmsrc, struct submesh
 	}
 
 	if(cmesh_indexed(cmsrc)) {
-		if(!(iarr = malloc(icount * sizeof *iarr))) {
-			free(name);
+		if(!(iarr = cm_alloc(cmdest, icount * sizeof *iarr))) {
+			cm_free_str(cmdest, name);
 			return -1;
 		}
 	}
@@ -265,12 +323,12 @@ static int clone(struct cmesh *cmdest, const struct cmesh *cmsrc, struct submesh
 	for(i=0; i<CMESH_NUM_ATTR; i++) {
 		if(cmesh_has_attrib(cmsrc, i)) {
 			nelem = cmsrc->vattr[i].nelem;
-			if(!(varr[i] = malloc(vcount * nelem * sizeof(float)))) {
+			if(!(varr[i] = cm_alloc(cmdest, vcount * nelem * sizeof(float)))) {
 				while(--i >= 0) {
-					free(varr[i]);
+					cm_free(cmdest, varr[i], vcount * cmsrc->vattr[i].nelem * sizeof(float));
 				}
-				free(iarr);
-				free(name);
+				cm_free(cmdest, iarr, icount * sizeof *iarr);
+				cm_free_str(cmdest, name);
 				return -1;
 			}
 		}
@@ -280,8 +338,6 @@ static int clone(struct cmesh *cmdest, const struct cmesh *cmsrc, struct submesh
 	cmesh_clear(cmdest);
 
 	for(i=0; i<CMESH_NUM_ATTR; i++) {
-		free(cmdest->vattr[i].data);
-
 		if(cmesh_has_attrib(cmsrc, i)) {
 			/* force validation of the actual data on the source mesh */
 			cmesh_attrib((struct cmesh*)cmsrc, i);
@@ -289,7 +345,7 @@ static int clone(struct cmesh *cmdest, const struct cmesh *cmsrc, struct submesh
 			nelem = cmsrc->vattr[i].nelem;
 			cmdest->vattr[i].nelem = nelem;
 			cmdest->vattr[i].data = varr[i];
-			cmdest->vattr[i].count = vcount * nelem;
+			cmdest->vattr[i].count = cmdest->vattr[i].cap = vcount * nelem;
 			vptr = cmsrc->vattr[i].data + vstart * nelem;
 			memcpy(cmdest->vattr[i].data, vptr, vcount * nelem * sizeof(float));
 			cmdest->vattr[i].data_valid = 1;
@@ -306,7 +362,7 @@ static int clone(struct cmesh *cmdest, const struct cmesh *cmsrc, struct submesh
 		cmesh_index((struct cmesh*)cmsrc);
 
 		cmdest->idata = iarr;
-		cmdest->icount = icount;
+		cmdest->icount = cmdest->icap = icount;
 		if(sub) {
 			/* need to offset all vertex indices by -vstart */
 			iptr = cmsrc->idata + istart;
@@ -325,7 +381,7 @@ static int clone(struct cmesh *cmdest, const struct cmesh *cmsrc, struct submesh
 #endif
 	}
 
-	free(cmdest->name);
+	cm_free_str(cmdest, cmdest->name);
 	cmdest->name = name;
 
 	cmdest->nverts = cmsrc->nverts;
@@ -346,12 +402,11 @@ static int clone(struct cmesh *cmdest, const struct cmesh *cmsrc, struct submesh
 
 		sm = cmsrc->sublist;
 		while(sm) {
-			if(!(n = malloc(sizeof *n)) || !(name = malloc(strlen(sm->name) + 1))) {
-				free(n);
+			if(!(n = cm_alloc(cmdest, sizeof *n)) || !(name = cm_strdup(cmdest, sm->name))) {
+				cm_free(cmdest, n, sizeof *n);
 				sm = sm->next;
 				continue;
 			}
-			strcpy(name, sm->name);
 			*n = *sm;
 			n->name = name;
 			n->next = 0;
@@ -375,12 +430,10 @@ static int clone(struct cmesh *cmdest, const struct cmesh *cmsrc, struct submesh
 
 int cmesh_set_name(struct cmesh *cm, const char *name)
 {
-	int len = strlen(name);
-	char *tmp = malloc(len + 1);
+	char *tmp = cm_strdup(cm, name);
 	if(!tmp) return -1;
-	free(cm->name);
+	cm_free_str(cm, cm->name);
 	cm->name = tmp;
-	memcpy(cm->name, name, len + 1);
 	return 0;
 }
 
@@ -425,7 +478,7 @@ float *cmesh_set_attrib(struct cmesh *cm, int attr, int nelem, unsigned int num,
 		return 0;
 	}
 
-	if(!(newarr = malloc(num * nelem * sizeof *newarr))) {
+	if(!(newarr = cm_alloc(cm, num * nelem * sizeof *newarr))) {
 		return 0;
 	}
 	if(vdata) {
@@ -434,9 +487,9 @@ float *cmesh_set_attrib(struct cmesh *cm, int attr, int nelem, unsigned int num,
 
 	cm->nverts = num;
 
-	free(cm->vattr[attr].data);
+	cm_free(cm, cm->vattr[attr].data, cm->vattr[attr].cap * sizeof(float));
 	cm->vattr[attr].data = newarr;
-	cm->vattr[attr].count = num * nelem;
+	cm->vattr[attr].count = cm->vattr[attr].cap = num * nelem;
 	cm->vattr[attr].nelem = nelem;
 	cm->vattr[attr].data_valid = 1;
 #ifdef USE_VBO
@@ -488,10 +541,12 @@ const float *cmesh_attrib_ro(const struct cmesh *cm, int attr)
 
 		/* local data copy unavailable, grab the data from the vbo */
 		nelem = m->vattr[attr].nelem;
-		if(!(m->vattr[attr].data = malloc(m->nverts * nelem * sizeof(float)))) {
+		cm_free(m, m->vattr[attr].data, m->vattr[attr].cap * sizeof(float));
+		m->vattr[attr].cap = 0;
+		if(!(m->vattr[attr].data = cm_alloc(m, m->nverts * nelem * sizeof(float)))) {
 			return 0;
 		}
-		m->vattr[attr].count = m->nverts * nelem;
+		m->vattr[attr].count = m->vattr[attr].cap = m->nverts * nelem;
 
 		glBindBuffer(GL_ARRAY_BUFFER, m->vattr[attr].vbo);
 		tmp = glMapBuffer(GL_ARRAY_BUFFER, GL_READ_ONLY);
@@ -529,7 +584,7 @@ int cmesh_attrib_nelem(const struct cmesh *cm, int attr)
 int cmesh_push_attrib(struct cmesh *cm, int attr, float *v)
 {
 	float *vptr;
-	int i, cursz, newsz;
+	unsigned int i, cursz, newsz, cap;
 
 	if(!cm->vattr[attr].nelem) {
 		cm->vattr[attr].nelem = def_nelem[attr];
@@ -537,14 +592,22 @@ int cmesh_push_attrib(struct cmesh *cm, int attr, float *v)
 
 	cursz = cm->vattr[attr].count;
 	newsz = cursz + cm->vattr[attr].nelem;
-	if(!(vptr = realloc(cm->vattr[attr].data, newsz * sizeof(float)))) {
-		return -1;
+	if(newsz > (cap = cm->vattr[attr].cap)) {
+		/* grow geometrically, pushing vertices one by one is common */
+		unsigned int newcap = cap ? cap * 2 : MIN_PUSH_CAP;
+		if(newcap < newsz) newcap = newsz;
+
+		if(!(vptr = cm_realloc(cm, cm->vattr[attr].data, cap * sizeof(float),
+						newcap * sizeof(float)))) {
+			return -1;
+		}
+		cm->vattr[attr].data = vptr;
+		cm->vattr[attr].cap = newcap;
 	}
-	cm->vattr[attr].data = vptr;
+	vptr = cm->vattr[attr].data + cursz;
 	cm->vattr[attr].count = newsz;
-	vptr += cursz;
 
-	for(i=0; i<cm->vattr[attr].nelem; i++) {
+	for(i=0; i<(unsigned int)cm->vattr[attr].nelem; i++) {
 		*vptr++ = *v++;
 	}
 	cm->vattr[attr].data_valid = 1;
@@ -615,16 +678,16 @@ unsigned int *cmesh_set_index(struct cmesh *cm, int num, const unsigned int *ind
 		return 0;
 	}
 
-	if(!(tmp = malloc(num * sizeof *tmp))) {
+	if(!(tmp = cm_alloc(cm, num * sizeof *tmp))) {
 		return 0;
 	}
 	if(indices) {
 		memcpy(tmp, indices, num * sizeof *tmp);
 	}
 
-	free(cm->idata);
+	cm_free(cm, cm->idata, cm->icap * sizeof *cm->idata);
 	cm->idata = tmp;
-	cm->icount = num;
+	cm->icount = cm->icap = num;
 	cm->nfaces = num / 3;
 	cm->idata_valid = 1;
 #ifdef USE_VBO
@@ -669,12 +732,12 @@ const unsigned int *cmesh_index_ro(const struct cmesh *cm)
 
 		/* local copy is unavailable, grab the data from the ibo */
 		nidx = m->nfaces * 3;
-		if(!(tmp = malloc(nidx * sizeof *m->idata))) {
+		if(!(tmp = cm_alloc(m, nidx * sizeof *m->idata))) {
 			return 0;
 		}
-		free(m->idata);
+		cm_free(m, m->idata, m->icap * sizeof *m->idata);
 		m->idata = tmp;
-		m->icount = nidx;
+		m->icount = m->icap = nidx;
 
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
 		tmp = glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_READ_ONLY);
@@ -696,11 +759,16 @@ int cmesh_push_index(struct cmesh *cm, unsigned int idx)
 {
 	unsigned int *iptr;
 	unsigned int cur_sz = cm->icount;
-	if(!(iptr = realloc(cm->idata, (cur_sz + 1) * sizeof *iptr))) {
-		return -1;
+
+	if(cur_sz >= cm->icap) {
+		unsigned int newcap = cm->icap ? cm->icap * 2 : MIN_PUSH_CAP;
+		if(!(iptr = cm_realloc(cm, cm->idata, cm->icap * sizeof *iptr, newcap * sizeof *iptr))) {
+			return -1;
+		}
+		cm->idata = iptr;
+		cm->icap = newcap;
 	}
-	iptr[cur_sz] = idx;
-	cm->idata = iptr;
+	cm->idata[cur_sz] = idx;
 	cm->icount = cur_sz + 1;
 	cm->idata_valid = 1;
 #ifdef USE_VBO
@@ -789,11 +857,16 @@ int cmesh_append(struct cmesh *cmdest, const struct cmesh *cmsrc)
 			origsz = cmdest->nverts * nelem;
 			newsz = (cmdest->nverts + cmsrc->nverts) * nelem;
 
-			if(!(vptr = realloc(cmdest->vattr[i].data, newsz * sizeof *vptr))) {
-				return -1;
+			if(newsz > (int)cmdest->vattr[i].cap) {
+				if(!(vptr = cm_realloc(cmdest, cmdest->vattr[i].data,
+								cmdest->vattr[i].cap * sizeof *vptr, newsz * sizeof *vptr))) {
+					return -1;
+				}
+				cmdest->vattr[i].data = vptr;
+				cmdest->vattr[i].cap = newsz;
 			}
+			vptr = cmdest->vattr[i].data;
 			memcpy(vptr + origsz, cmsrc->vattr[i].data, cmsrc->nverts * nelem * sizeof(float));
-			cmdest->vattr[i].data = vptr;
 			cmdest->vattr[i].count = newsz;
 		}
 	}
@@ -809,10 +882,15 @@ int cmesh_append(struct cmesh *cmdest, const struct cmesh *cmsrc)
 		srcsz = cmsrc->icount;
 		newsz = origsz + srcsz;
 
-		if(!(iptr = realloc(cmdest->idata, newsz * sizeof *iptr))) {
-			return -1;
+		if(newsz > (int)cmdest->icap) {
+			if(!(iptr = cm_realloc(cmdest, cmdest->idata, cmdest->icap * sizeof *iptr,
+							newsz * sizeof *iptr))) {
+				return -1;
+			}
+			cmdest->idata = iptr;
+			cmdest->icap = newsz;
 		}
-		cmdest->idata = iptr;
+		iptr = cmdest->idata;
 		cmdest->icount = newsz;
 
 		/* copy and fixup all the new indices */
@@ -840,8 +918,8 @@ void cmesh_clear_submeshes(struct cmesh *cm)
 	while(cm->sublist) {
 		sm = cm->sublist;
 		cm->sublist = cm->sublist->next;
-		free(sm->name);
-		free(sm);
+		cm_free_str(cm, sm->name);
+		cm_free(cm, sm, sizeof *sm);
 	}
 	cm->subcount = 0;
 }
@@ -857,11 +935,10 @@ int cmesh_submesh(struct cmesh *cm, const char *name, int fstart, int fcount)
 		return -1;
 	}
 
-	if(!(sm = malloc(sizeof *sm)) || !(sm->name = malloc(strlen(name) + 1))) {
-		free(sm);
+	if(!(sm = cm_alloc(cm, sizeof *sm)) || !(sm->name = cm_strdup(cm, name))) {
+		cm_free(cm, sm, sizeof *sm);
 		return -1;
 	}
-	strcpy(sm->name, name);
 	sm->nfaces = fcount;
 
 	if(cmesh_indexed(cm)) {
@@ -908,8 +985,8 @@ int cmesh_remove_submesh(struct cmesh *cm, int idx)
 	if(!(sm = prev->next)) return -1;
 
 	prev->next = sm->next;
-	free(sm->name);
-	free(sm);
+	cm_free_str(cm, sm->name);
+	cm_free(cm, sm, sizeof *sm);
 
 	cm->subcount--;
 	assert(cm->subcount >= 0);
@@ -974,9 +1051,9 @@ int cmesh_vertex(struct cmesh *cm, float x, float y, float z)
 	}
 
 	if(cm->idata_valid) {
-		free(cm->idata);
+		cm_free(cm, cm->idata, cm->icap * sizeof *cm->idata);
 		cm->idata = 0;
-		cm->icount = 0;
+		cm->icount = cm->icap = 0;
 	}
 #ifdef USE_VBO
 	cm->ibo_valid = 0;
@@ -1160,7 +1237,7 @@ int cmesh_explode(struct cmesh *cm)
 		if(!cmesh_has_attrib(cm, i)) continue;
 
 		srcbuf = cmesh_attrib(cm, i);
-		if(!(tmpbuf = malloc(nnverts * cm->vattr[i].nelem * sizeof(float)))) {
+		if(!(tmpbuf = cm_alloc(cm, nnverts * cm->vattr[i].nelem * sizeof(float)))) {
 			return -1;
 		}
 		dstptr = tmpbuf;
@@ -1174,9 +1251,9 @@ int cmesh_explode(struct cmesh *cm)
 			}
 		}
 
-		free(cm->vattr[i].data);
+		cm_free(cm, cm->vattr[i].data, cm->vattr[i].cap * sizeof(float));
 		cm->vattr[i].data = tmpbuf;
-		cm->vattr[i].count = nnverts * cm->vattr[i].nelem;
+		cm->vattr[i].count = cm->vattr[i].cap = nnverts * cm->vattr[i].nelem;
 		cm->vattr[i].data_valid = 1;
 	}
 
@@ -1190,9 +1267,9 @@ int cmesh_explode(struct cmesh *cm)
 	}
 #endif
 	cm->idata_valid = 0;
-	free(cm->idata);
+	cm_free(cm, cm->idata, cm->icap * sizeof *cm->idata);
 	cm->idata = 0;
-	cm->icount = 0;
+	cm->icount = cm->icap = 0;
 
 	cm->nverts = nnverts;
 	cm->nfaces = idxnum / 3;
@@ -18,6 +18,7 @@ enum {
 };
 
 struct cmesh;
+struct mem_allocator;	/* see arena.h */
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,6 +36,17 @@ void cmesh_free(struct cmesh *cm);
 int cmesh_init(struct cmesh *cm);
 void cmesh_destroy(struct cmesh *cm);
 
+/* Allocate all mesh data (attributes, indices, names and submeshes) from the
+ * specified allocator, for instance an arena (see arena.h), instead of
+ * malloc. Call it right after cmesh_alloc/cmesh_init, before adding any data.
+ * The mesh structure itself is not affected.
+ * With an arena, this pays off for meshes built with their final sizes known
+ * (cmesh_set_attrib, cmesh_set_index, cmesh_clone); appending vertices or
+ * indices one by one grows the arrays, and every growth which can't happen in
+ * place leaves the old copy dead in the arena until it's reset.
+ */
+void cmesh_set_allocator(struct cmesh *cm, struct mem_allocator *ator);
+
 void cmesh_clear(struct cmesh *cm);
 int cmesh_clone(struct cmesh *cmdest, const struct cmesh *cmsrc);
 
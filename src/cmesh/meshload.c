@@ -12,6 +12,7 @@
 #include <assimp/types.h>
 #else
 #include "dynarr.h"
+#include "arena.h"
 #include "rbtree.h"
 #endif
 
@@ -98,9 +99,8 @@ struct facevertex {
 };
 
 static char *clean_line(char *s);
-static char *parse_face_vert(char *ptr, struct facevertex *fv, int numv, int numt, int numn);
+static char *parse_face_vert(char *ptr, struct facevertex *fv, size_t numv, size_t numt, size_t numn);
 static int cmp_facevert(const void *ap, const void *bp);
-static void free_rbnode_key(struct rbnode *n, void *cls);
 
 /* merge of different indices per attribute happens during face processing.
  *
@@ -112,6 +112,10 @@ static void free_rbnode_key(struct rbnode *n, void *cls);
  * If a particular triplet has not been encountered before, a new vertex is
  * appended to the vertex buffer. The index of this new vertex is appended to
  * the index buffer, and also inserted into the tree for future searches.
+ *
+ * The tree keys are allocated from an arena, which is released in one go at
+ * the end. The temporary attribute arrays stay on the heap: they grow all the
+ * time, and an arena can only grow its last allocation in place.
  */
 int cmesh_load(struct cmesh *mesh, const char *fname)
 {
@@ -123,6 +127,7 @@ int cmesh_load(struct cmesh *mesh, const char *fname)
 	cgm_vec3 *narr = 0;
 	cgm_vec2 *tarr = 0;
 	struct rbtree *rbtree = 0;
+	struct arena *arena = 0;
 	char *subname = 0;
 	int substart = 0, subcount = 0;
 
@@ -135,7 +140,11 @@ int cmesh_load(struct cmesh *mesh, const char *fname)
 		fprintf(stderr, "load_mesh: failed to create facevertex binary search tree\n");
 		goto err;
 	}
-	rb_set_delete_func(rbtree, free_rbnode_key, 0);
+
+	if(!(arena = arena_create(0))) {
+		fprintf(stderr, "load_mesh: failed to create memory arena\n");
+		goto err;
+	}
 
 	if(!(varr = dynarr_alloc(0, sizeof *varr)) ||
 			!(narr = dynarr_alloc(0, sizeof *narr)) ||
@@ -200,9 +209,9 @@ int cmesh_load(struct cmesh *mesh, const char *fname)
 				char *ptr = line + 2;
 				struct facevertex fv;
 				struct rbnode *node;
-				int vsz = dynarr_size(varr);
-				int tsz = dynarr_size(tarr);
-				int nsz = dynarr_size(narr);
+				size_t vsz = dynarr_size(varr);
+				size_t tsz = dynarr_size(tarr);
+				size_t nsz = dynarr_size(narr);
 
 				for(i=0; i<4; i++) {
 					if(!(ptr = parse_face_vert(ptr, &fv, vsz, tsz, nsz))) {
@@ -255,7 +264,7 @@ int cmesh_load(struct cmesh *mesh, const char *fname)
 						}
 						subcount++;	/* inc number of submesh indices, in case we have submeshes */
 
-						if((newfv = malloc(sizeof *newfv))) {
+						if((newfv = arena_alloc(arena, sizeof *newfv))) {
 							*newfv = fv;
 						}
 						if(!newfv || rb_insert(rbtree, newfv, (void*)newidx) == -1) {
@@ -313,6 +322,7 @@ err:
 	dynarr_free(narr);
 	dynarr_free(tarr);
 	rb_free(rbtree);
+	arena_destroy(arena);	/* frees the tree keys */
 	free(subname);
 	return result;
 }
@@ -336,14 +346,15 @@ static char *clean_line(char *s)
 	return s;
 }
 
-static char *parse_idx(char *ptr, int *idx, int arrsz)
+static char *parse_idx(char *ptr, int *idx, size_t arrsz)
 {
 	char *endp;
-	int val = strtol(ptr, &endp, 10);
+	long val = strtol(ptr, &endp, 10);
 	if(endp == ptr) return 0;
 
 	if(val < 0) {	/* convert negative indices */
-		*idx = arrsz + val;
+		if((size_t)-val > arrsz) return 0;
+		*idx = (int)(arrsz - (size_t)-val);
 	} else {
 		*idx = val - 1;	/* indices in obj are 1-based */
 	}
@@ -356,7 +367,7 @@ static char *parse_idx(char *ptr, int *idx, int arrsz)
  * 3. vertex//normal
  * 4. vertex/texcoord/normal
  */
-static char *parse_face_vert(char *ptr, struct facevertex *fv, int numv, int numt, int numn)
+static char *parse_face_vert(char *ptr, struct facevertex *fv, size_t numv, size_t numt, size_t numn)
 {
 	if(!(ptr = parse_idx(ptr, &fv->vidx, numv)))
 		return 0;
@@ -390,9 +401,4 @@ static int cmp_facevert(const void *ap, const void *bp)
 	}
 	return a->vidx - b->vidx;
 }
-
-static void free_rbnode_key(struct rbnode *n, void *cls)
-{
-	free(n->key);
-}
 #endif
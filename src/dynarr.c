@@ -2,71 +2,350 @@
  * author: John Tsiombikas <nuclear@member.fsf.org>
  * license: public domain
  */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* for MAP_ANONYMOUS and MAP_NORESERVE */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "dynarr.h"
+#include "arena.h"
+
+#if defined(__APPLE__) && !defined(__unix__)
+#define __unix__
+#endif
+
+#if defined(unix) || defined(__unix__)
+#include <unistd.h>
+#include <sys/mman.h>
+#define HAVE_VM
+#elif defined(WIN32) || defined(__WIN32__)
+#include <windows.h>
+#define HAVE_VM
+#endif
 
 /* The array descriptor keeps auxilliary information needed to manipulate
- * the dynamic array. It's allocated adjacent to the array buffer.
+ * the dynamic array. It's allocated adjacent to the array buffer, which starts
+ * DYNARR_DESC_SIZE bytes after it, to keep the array suitably aligned for any
+ * type, and so that callers can size inline buffers.
  */
 struct arrdesc {
-	int nelem, szelem;
-	int max_elem;
-	int bufsz;	/* not including the descriptor */
+	size_t nelem, szelem;
+	size_t max_elem;
+	struct mem_allocator *ator;	/* null for malloc */
+	/* growth policy, see dynarr_set_growth */
+	size_t min_elem;
+	float grow;
+	unsigned int flags;
+	/* storage not from the allocator (DA_VM or DA_INLINE): size of the reserved
+	 * address range or of the caller's buffer, and the committed part at its
+	 * start (vm only). Both include the descriptor.
+	 */
+	size_t stor_size, stor_used;
 };
 
-#define DESC(x)		((struct arrdesc*)((char*)(x) - sizeof(struct arrdesc)))
+/* descriptor flags */
+enum {
+	DA_SHRINK	= 1,	/* shrink on pop */
+	DA_VM		= 2,	/* lives in reserved virtual memory */
+	DA_INLINE	= 4		/* still in the caller's buffer */
+};
+
+#define DESC_SIZE	DYNARR_DESC_SIZE
+#define DESC(x)		((struct arrdesc*)((char*)(x) - DESC_SIZE))
+
+/* fails to compile if the descriptor outgrows its space */
+typedef char desc_size_check[sizeof(struct arrdesc) <= DESC_SIZE ? 1 : -1];
 
-void *dynarr_alloc(int elem, int szelem)
+#define DEF_GROW		2.0f
+#define DEF_MIN_ELEM	1
+
+#define MAX_SIZE		((size_t)-1)
+
+#define BUFSZ(desc)		((desc)->max_elem * (desc)->szelem + DESC_SIZE)
+
+#ifdef HAVE_VM
+static size_t vm_pagesize(void);
+static void *vm_reserve(size_t sz);
+static int vm_commit(void *p, size_t sz);
+static void vm_decommit(void *p, size_t sz);
+static void vm_release(void *p, size_t sz);
+#endif
+
+/* max number of elements the array can ever hold */
+static size_t max_capacity(struct arrdesc *desc)
 {
-	struct arrdesc *desc;
+	size_t avail = desc->flags & DA_VM ? desc->stor_size : MAX_SIZE;
+
+	if(!desc->szelem) {
+		return MAX_SIZE;
+	}
+	return (avail - DESC_SIZE) / desc->szelem;
+}
+
+#ifdef HAVE_VM
+/* commit or decommit pages at the end of the used part of a reserved range,
+ * so that it covers newsz bytes.
+ */
+static int vm_resize(struct arrdesc *desc, size_t newsz)
+{
+	size_t pgsz = vm_pagesize();
+	size_t used = (newsz + pgsz - 1) / pgsz * pgsz;
+
+	if(used > desc->stor_used) {
+		if(vm_commit((char*)desc + desc->stor_used, used - desc->stor_used) == -1) {
+			return -1;
+		}
+	} else if(used < desc->stor_used) {
+		vm_decommit((char*)desc + used, desc->stor_used - used);
+	}
+	desc->stor_used = used;
+	return 0;
+}
+#endif
 
-	if(!(desc = malloc(elem * szelem + sizeof *desc))) {
+/* reallocate the buffer to hold max_elem elements, keeping the contents and
+ * the number of elements (truncated if necessary).
+ */
+static void *set_capacity(void *da, size_t max_elem)
+{
+	size_t newsz;
+	void *tmp;
+	struct arrdesc *desc = DESC(da);
+
+	if(max_elem > max_capacity(desc)) {
 		return 0;
 	}
+	newsz = desc->szelem * max_elem;
+
+	if(desc->flags & DA_INLINE) {
+		if(newsz + DESC_SIZE > desc->stor_size) {
+			/* outgrew the caller's buffer, move to the heap */
+			size_t nelem = desc->nelem < max_elem ? desc->nelem : max_elem;
+			if(!(tmp = malloc(newsz + DESC_SIZE))) {
+				return 0;
+			}
+			memcpy(tmp, desc, DESC_SIZE + nelem * desc->szelem);
+			desc = tmp;
+			desc->flags &= ~DA_INLINE;
+			desc->stor_size = 0;
+		} else if(desc->szelem) {
+			/* still in the caller's buffer, which can't shrink: keep all of it
+			 * available, so that clearing it doesn't move it to the heap on
+			 * the next push.
+			 */
+			max_elem = (desc->stor_size - DESC_SIZE) / desc->szelem;
+		}
+	} else
+#ifdef HAVE_VM
+	if(desc->flags & DA_VM) {
+		if(vm_resize(desc, newsz + DESC_SIZE) == -1) {
+			return 0;
+		}
+	} else
+#endif
+	if(desc->ator) {
+		if(!(tmp = desc->ator->realloc(desc, BUFSZ(desc), newsz + DESC_SIZE, desc->ator->cls))) {
+			return 0;
+		}
+		desc = tmp;
+	} else {
+		if(!(tmp = realloc(desc, newsz + DESC_SIZE))) {
+			return 0;
+		}
+		desc = tmp;
+	}
+
+	desc->max_elem = max_elem;
+	if(desc->nelem > max_elem) {
+		desc->nelem = max_elem;
+	}
+	return (char*)desc + DESC_SIZE;
+}
+
+/* next capacity for an array which needs room for at least "need" elements */
+static size_t grow_capacity(struct arrdesc *desc, size_t need)
+{
+	size_t limit = max_capacity(desc);
+	double grown = (double)desc->max_elem * desc->grow;
+	size_t newmax = grown >= (double)limit ? limit : (size_t)grown;
+
+	if(newmax <= desc->max_elem) {
+		newmax = desc->max_elem + 1;
+	}
+	if(newmax < desc->min_elem) {
+		newmax = desc->min_elem;
+	}
+	if(newmax < need) {
+		newmax = need;
+	}
+	/* growing by less than the policy asks for is better than failing */
+	if(newmax > limit && need <= limit) {
+		newmax = limit;
+	}
+	return newmax;
+}
+
+static void init_desc(struct arrdesc *desc, size_t elem, size_t szelem)
+{
 	desc->nelem = desc->max_elem = elem;
 	desc->szelem = szelem;
-	desc->bufsz = elem * szelem;
-	return (char*)desc + sizeof *desc;
+	desc->ator = 0;
+	desc->grow = DEF_GROW;
+	desc->min_elem = DEF_MIN_ELEM;
+	desc->flags = DA_SHRINK;
+	desc->stor_size = desc->stor_used = 0;
 }
 
-void *dynarr_alloc_nf(int elem, int szelem)
+void *dynarr_alloc(size_t elem, size_t szelem)
+{
+	return dynarr_alloc_ator(elem, szelem, 0);
+}
+
+void *dynarr_alloc_ator(size_t elem, size_t szelem, struct mem_allocator *ator)
+{
+	struct arrdesc *desc;
+	size_t sz;
+
+	if(szelem && elem > (MAX_SIZE - DESC_SIZE) / szelem) {
+		return 0;
+	}
+	sz = elem * szelem + DESC_SIZE;
+
+	if(!(desc = ator ? ator->alloc(sz, ator->cls) : malloc(sz))) {
+		return 0;
+	}
+	init_desc(desc, elem, szelem);
+	desc->ator = ator;
+	return (char*)desc + DESC_SIZE;
+}
+
+void *dynarr_alloc_nf(size_t elem, size_t szelem)
 {
 	void *arr = dynarr_alloc(elem, szelem);
 	if(!arr) {
-		fprintf(stderr, "failed to allocate dynamic array (%d * %d bytes)\n", elem, szelem);
+		fprintf(stderr, "failed to allocate dynamic array (%lu * %lu bytes)\n",
+				(unsigned long)elem, (unsigned long)szelem);
 		abort();
 	}
 	return arr;
 }
 
+void *dynarr_alloc_vm(size_t elem, size_t szelem, size_t max_elem)
+{
+#ifdef HAVE_VM
+	struct arrdesc *desc;
+	size_t pgsz, vmsz;
+	void *da;
+
+	if(elem > max_elem) {
+		return 0;
+	}
+	if(szelem && max_elem > (MAX_SIZE - DESC_SIZE - vm_pagesize()) / szelem) {
+		return 0;
+	}
+	pgsz = vm_pagesize();
+	vmsz = (max_elem * szelem + DESC_SIZE + pgsz - 1) / pgsz * pgsz;
+
+	if(!(desc = vm_reserve(vmsz))) {
+		return 0;
+	}
+	/* commit the first page for the descriptor, and the rest as needed */
+	if(vm_commit(desc, pgsz) == -1) {
+		vm_release(desc, vmsz);
+		return 0;
+	}
+	init_desc(desc, 0, szelem);
+	desc->flags |= DA_VM;
+	desc->stor_size = vmsz;
+	desc->stor_used = pgsz;
+
+	if(!(da = set_capacity((char*)desc + DESC_SIZE, elem))) {
+		vm_release(desc, vmsz);
+		return 0;
+	}
+	DESC(da)->nelem = elem;
+	return da;
+#else
+	return dynarr_alloc(elem, szelem);
+#endif
+}
+
+void *dynarr_alloc_inline(void *buf, size_t bufsz, size_t szelem)
+{
+	struct arrdesc *desc = buf;
+
+	if(bufsz < DESC_SIZE) {
+		return 0;
+	}
+	init_desc(desc, 0, szelem);
+	desc->flags |= DA_INLINE;
+	desc->stor_size = bufsz;
+	desc->max_elem = szelem ? (bufsz - DESC_SIZE) / szelem : MAX_SIZE;
+	return (char*)desc + DESC_SIZE;
+}
+
 void dynarr_free(void *da)
 {
+	struct arrdesc *desc;
+
 	if(da) {
-		free(DESC(da));
+		desc = DESC(da);
+		if(desc->flags & DA_INLINE) {
+			return;	/* the caller's buffer */
+		}
+#ifdef HAVE_VM
+		if(desc->flags & DA_VM) {
+			vm_release(desc, desc->stor_size);
+			return;
+		}
+#endif
+		if(desc->ator) {
+			desc->ator->free(desc, BUFSZ(desc), desc->ator->cls);
+		} else {
+			free(desc);
+		}
 	}
 }
 
-void *dynarr_resize(void *da, int elem)
+void *dynarr_resize(void *da, size_t elem)
 {
-	int newsz;
-	void *tmp;
-	struct arrdesc *desc;
+	if(!da) return 0;
 
+	if(!(da = set_capacity(da, elem))) {
+		return 0;
+	}
+	DESC(da)->nelem = elem;
+	return da;
+}
+
+void *dynarr_reserve(void *da, size_t elem)
+{
 	if(!da) return 0;
-	desc = DESC(da);
 
-	newsz = desc->szelem * elem;
+	if(elem <= DESC(da)->max_elem) {
+		return da;
+	}
+	return set_capacity(da, elem);
+}
 
-	if(!(tmp = realloc(desc, newsz + sizeof *desc))) {
-		return 0;
+void dynarr_set_growth(void *da, float factor, size_t min_elem, int shrink)
+{
+	struct arrdesc *desc = DESC(da);
+
+	desc->grow = factor > 1.0f ? factor : DEF_GROW;
+	desc->min_elem = min_elem > 0 ? min_elem : DEF_MIN_ELEM;
+	if(shrink) {
+		desc->flags |= DA_SHRINK;
+	} else {
+		desc->flags &= ~DA_SHRINK;
 	}
-	desc = tmp;
+}
 
-	desc->nelem = desc->max_elem = elem;
-	desc->bufsz = newsz;
-	return (char*)desc + sizeof *desc;
+size_t dynarr_capacity(void *da)
+{
+	return DESC(da)->max_elem;
 }
 
 int dynarr_empty(void *da)
@@ -74,7 +353,7 @@ int dynarr_empty(void *da)
 	return DESC(da)->nelem ? 0 : 1;
 }
 
-int dynarr_size(void *da)
+size_t dynarr_size(void *da)
 {
 	return DESC(da)->nelem;
 }
@@ -89,23 +368,18 @@ void *dynarr_clear(void *da)
 void *dynarr_push(void *da, void *item)
 {
 	struct arrdesc *desc;
-	int nelem;
+	size_t nelem;
 
 	desc = DESC(da);
 	nelem = desc->nelem;
 
 	if(nelem >= desc->max_elem) {
 		/* need to resize */
-		struct arrdesc *tmp;
-		int newsz = desc->max_elem ? desc->max_elem * 2 : 1;
-
-		if(!(tmp = dynarr_resize(da, newsz))) {
-			fprintf(stderr, "failed to resize\n");
-			return da;
+		if(nelem >= max_capacity(desc) ||
+				!(da = set_capacity(da, grow_capacity(desc, nelem + 1)))) {
+			return 0;
 		}
-		da = tmp;
 		desc = DESC(da);
-		desc->nelem = nelem;
 	}
 
 	if(item) {
@@ -115,28 +389,55 @@ void *dynarr_push(void *da, void *item)
 	return da;
 }
 
+void *dynarr_push_n(void *da, void *items, size_t n)
+{
+	struct arrdesc *desc;
+	size_t nelem;
+
+	if(!n) return da;
+
+	desc = DESC(da);
+	nelem = desc->nelem;
+
+	if(n > MAX_SIZE - nelem) {
+		return 0;
+	}
+	if(nelem + n > desc->max_elem) {
+		if(!(da = set_capacity(da, grow_capacity(desc, nelem + n)))) {
+			return 0;
+		}
+		desc = DESC(da);
+	}
+
+	if(items) {
+		memcpy((char*)da + nelem * desc->szelem, items, n * desc->szelem);
+	}
+	desc->nelem += n;
+	return da;
+}
+
 void *dynarr_pop(void *da)
 {
 	struct arrdesc *desc;
-	int nelem;
+	size_t nelem;
 
 	desc = DESC(da);
 	nelem = desc->nelem;
 
 	if(!nelem) return da;
 
-	if(nelem <= desc->max_elem / 3) {
-		/* reclaim space */
-		struct arrdesc *tmp;
-		int newsz = desc->max_elem / 2;
+	/* shrinking can't give back any of the caller's buffer, so it only kicks
+	 * in after the array has moved to the heap.
+	 */
+	if((desc->flags & (DA_SHRINK | DA_INLINE)) == DA_SHRINK &&
+			nelem <= desc->max_elem / 3 && desc->max_elem / 2 >= desc->min_elem) {
+		/* reclaim space, or just keep the bigger buffer if that fails */
+		void *tmp;
 
-		if(!(tmp = dynarr_resize(da, newsz))) {
-			fprintf(stderr, "failed to resize\n");
-			return da;
+		if((tmp = set_capacity(da, desc->max_elem / 2))) {
+			da = tmp;
+			desc = DESC(da);
 		}
-		da = tmp;
-		desc = DESC(da);
-		desc->nelem = nelem;
 	}
 	desc->nelem--;
 
@@ -146,6 +447,89 @@ void *dynarr_pop(void *da)
 void *dynarr_finalize(void *da)
 {
 	struct arrdesc *desc = DESC(da);
-	memmove(desc, da, desc->bufsz);
+
+	if(desc->flags & (DA_VM | DA_INLINE)) {
+		/* has to be moved to the heap, so that it can be released with free.
+		 * allocate at least one element, so that null only means failure.
+		 */
+		void *arr;
+		if(!(arr = malloc((desc->nelem ? desc->nelem : 1) * desc->szelem))) {
+			return 0;
+		}
+		memcpy(arr, da, desc->nelem * desc->szelem);
+#ifdef HAVE_VM
+		if(desc->flags & DA_VM) {
+			vm_release(desc, desc->stor_size);
+		}
+#endif
+		return arr;
+	}
+
+	memmove(desc, da, desc->nelem * desc->szelem);
 	return desc;
 }
+
+#if defined(unix) || defined(__unix__)
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS	MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE	0
+#endif
+
+static size_t vm_pagesize(void)
+{
+	return sysconf(_SC_PAGESIZE);
+}
+
+static void *vm_reserve(size_t sz)
+{
+	void *p = mmap(0, sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return p == MAP_FAILED ? 0 : p;
+}
+
+static int vm_commit(void *p, size_t sz)
+{
+	return mprotect(p, sz, PROT_READ | PROT_WRITE);
+}
+
+static void vm_decommit(void *p, size_t sz)
+{
+	/* drop the pages, so that they don't count against the process anymore */
+	mmap(p, sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+static void vm_release(void *p, size_t sz)
+{
+	munmap(p, sz);
+}
+
+#elif defined(WIN32) || defined(__WIN32__)
+
+static size_t vm_pagesize(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+}
+
+static void *vm_reserve(size_t sz)
+{
+	return VirtualAlloc(0, sz, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+static int vm_commit(void *p, size_t sz)
+{
+	return VirtualAlloc(p, sz, MEM_COMMIT, PAGE_READWRITE) ? 0 : -1;
+}
+
+static void vm_decommit(void *p, size_t sz)
+{
+	VirtualFree(p, sz, MEM_DECOMMIT);
+}
+
+static void vm_release(void *p, size_t sz)
+{
+	VirtualFree(p, 0, MEM_RELEASE);
+}
+#endif
@@ -8,6 +8,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+struct mem_allocator;	/* see arena.h */
+
+/* size of the descriptor in front of every array */
+#define DYNARR_DESC_SIZE	64
+
 /* The _nf suffixed variants (no-fail) check the result of the operation,
  * and call abort on failure.
  *
@@ -28,28 +33,95 @@
  *  dynarr_free(arr);
  */
 
-void *dynarr_alloc(int elem, int szelem);
-void *dynarr_alloc_nf(int elem, int szelem);
+void *dynarr_alloc(size_t elem, size_t szelem);
+void *dynarr_alloc_nf(size_t elem, size_t szelem);
+/* allocate the array, and all its future resizing, from the specified
+ * allocator (see arena.h). A null allocator is the same as dynarr_alloc.
+ * With an arena, reserve the final size up front if possible: every growth
+ * which can't happen in place leaves the old buffer dead in the arena.
+ */
+void *dynarr_alloc_ator(size_t elem, size_t szelem, struct mem_allocator *ator);
+/* Allocate an array in a range of virtual memory reserved for up to max_elem
+ * elements. Memory is only committed as the array grows, so huge arrays can
+ * be reserved up front at no cost, and they grow in place instead of being
+ * copied. The array never moves, so pointers into it stay valid. Growing past
+ * max_elem fails. Where virtual memory reservation isn't available, it's the
+ * same as dynarr_alloc.
+ */
+void *dynarr_alloc_vm(size_t elem, size_t szelem, size_t max_elem);
+/* Small-buffer arrays: start out in storage provided by the caller (on the
+ * stack, or embedded in a structure), and only move to the heap when they
+ * outgrow it. The buffer holds the descriptor as well as the elements, and
+ * must outlive the array; use DYNARR_INLINE_BUF to declare one, suitably
+ * sized and aligned:
+ *
+ * DYNARR_INLINE_BUF(buf, 16, sizeof(int));
+ * int *arr = dynarr_alloc_inline(&buf, sizeof buf, sizeof *arr);
+ * ... push/pop as usual, never passing the buffer to anything else ...
+ * dynarr_free(arr);	(a no-op until it moves to the heap)
+ *
+ * Returns null if bufsz is too small for the descriptor.
+ */
+void *dynarr_alloc_inline(void *buf, size_t bufsz, size_t szelem);
+#define DYNARR_INLINE_BUF(name, nelem, szelem) \
+	union { \
+		char buf[DYNARR_DESC_SIZE + (nelem) * (szelem)]; \
+		void *align_p; \
+		double align_d; \
+		long double align_ld; \
+		long align_l; \
+	} name
+
 void dynarr_free(void *da);
-void *dynarr_resize(void *da, int elem);
+/* All size calculations are checked for overflow, and fail instead. */
+void *dynarr_resize(void *da, size_t elem);
+
+/* dynarr_reserve makes room for at least elem elements, without changing
+ * the size of the array, so that pushing up to that many doesn't reallocate.
+ * Returns the new array pointer, or null on failure (the array is unchanged).
+ */
+void *dynarr_reserve(void *da, size_t elem);
+/* returns the number of elements the array can hold without reallocating */
+size_t dynarr_capacity(void *da);
+
+/* Set the growth policy of the array. When it runs out of space, its capacity
+ * is multiplied by factor (default 2), starting from min_elem (default 1).
+ * If shrink is non-zero (default), popping down to 1/3 of the capacity halves
+ * it, but not below min_elem. Passing 0 for factor or min_elem resets it to
+ * the default.
+ */
+void dynarr_set_growth(void *da, float factor, size_t min_elem, int shrink);
 
 /* dynarr_empty returns non-zero if the array is empty
  * Complexity: O(1) */
 int dynarr_empty(void *da);
 /* dynarr_size returns the number of elements in the array
  * Complexity: O(1) */
-int dynarr_size(void *da);
+size_t dynarr_size(void *da);
 
 void *dynarr_clear(void *da);
 
-/* stack semantics */
+/* stack semantics
+ * dynarr_push returns the new array pointer, or null on failure (the array is
+ * unchanged). dynarr_pop can't fail; if shrinking the array fails, it keeps
+ * the bigger buffer.
+ */
 void *dynarr_push(void *da, void *item);
 void *dynarr_pop(void *da);
 
+/* append n elements copied from items (or left uninitialized if items is
+ * null), growing the array at most once.
+ * Returns the new array pointer, or null on failure (the array is unchanged).
+ */
+void *dynarr_push_n(void *da, void *items, size_t n);
+
 /* Finalize the array. No more resizing is possible after this call.
- * Use free() instead of dynarr_free() to deallocate a finalized array.
+ * Use free() instead of dynarr_free() to deallocate a finalized array, or
+ * for arrays allocated with dynarr_alloc_ator, leave it to the allocator.
  * Returns pointer to the finalized array.
- * dynarr_finalize can't fail.
+ * dynarr_finalize can't fail, except for arrays allocated with dynarr_alloc_vm,
+ * or small-buffer arrays still in the caller's buffer, which are copied to
+ * the heap, and null is returned if that fails.
  * Complexity: O(n)
  */
 void *dynarr_finalize(void *da);
@@ -76,6 +148,20 @@ void *dynarr_finalize(void *da);
 			abort(); \
 		} \
 	} while(0)
+#define dynarr_push_n_nf(da, items, n) \
+	do { \
+		if(!((da) = dynarr_push_n((da), (items), (n)))) { \
+			fprintf(stderr, "failed to append to dynamic array\n"); \
+			abort(); \
+		} \
+	} while(0)
+#define dynarr_reserve_nf(da, n) \
+	do { \
+		if(!((da) = dynarr_reserve((da), (n)))) { \
+			fprintf(stderr, "failed to reserve space in dynamic array\n"); \
+			abort(); \
+		} \
+	} while(0)
 #define dynarr_pop_nf(da) \
 	do { \
 		if(!((da) = dynarr_pop(da))) { \
@@ -3,6 +3,12 @@
 #define INTRUSIVE_LINKED_LIST_H_
 
 #include <stddef.h>
+#include <string.h>
+
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#include <atomic>
+#define INLIST_HAVE_ATOMIC
+#endif
 
 template <typename T>
 class InListNode {
@@ -39,6 +45,153 @@ public:
 	InListNode<T> *tail() const;
 };
 
+// Intrusive hash table with LRU ordering, for caches of objects which embed an
+// InCacheNode at offset offs. Lookup, touch and eviction are O(1), and there
+// are no allocations per entry, only for the bucket array as it grows.
+// When the total size of the cached items exceeds the byte budget, the least
+// recently used ones are evicted and passed to the evict callback, which
+// usually deletes them. Items are considered used when inserted, looked up
+// with find, or touched.
+//
+// Keys are hashed and compared with H (InHash<K> by default), which handles
+// integers, pointers and other plain-old-data keys (without padding) by value,
+// and C strings by contents. Other key types need a specialization of InHash,
+// for instance:
+//
+// template <> struct InHash<std::string> {
+//     static unsigned int hash(const std::string &s) { return InHash<const char*>::hash(s.c_str()); }
+//     static bool equal(const std::string &a, const std::string &b) { return a == b; }
+// };
+//
+// Not thread-safe.
+template <typename K>
+struct InHash {
+	static unsigned int hash(const K &key);
+	static bool equal(const K &a, const K &b);
+};
+
+template <typename T, typename K>
+class InCacheNode {
+public:
+	// first, so that it's at the same offset as the InCacheNode, which is what
+	// the LRU InList of the cache expects
+	InListNode<T> lnode;
+	K key;
+	size_t size;		// bytes charged against the cache budget
+	unsigned int hash;
+	InCacheNode<T,K> *hnext;	// next in the hash bucket
+
+	InCacheNode();
+};
+
+template <typename T, typename K, int offs, typename H = InHash<K> >
+class InCache {
+private:
+	InCacheNode<T,K> **buckets;
+	unsigned int nbuckets;	// power of two, or 0 before the first insert
+	size_t total_sz, max_sz;
+	InList<T, offs> lru;	// least recently used first
+
+	void (*evict_func)(T*, void*);
+	void *evict_cls;
+
+	InCacheNode<T,K> *node(T *item) const;
+	InCacheNode<T,K> *lookup(const K &key) const;
+	bool cached(InCacheNode<T,K> *n) const;
+	void unhash(InCacheNode<T,K> *n);
+	void rehash(unsigned int count);
+
+	InCache(const InCache&);
+	InCache &operator =(const InCache&);
+
+public:
+	// max_size is the byte budget, 0 for unlimited
+	explicit InCache(size_t max_size = 0);
+	~InCache();
+
+	// removes all items from the cache, without calling the evict function
+	void clear();
+
+	bool empty() const;
+	int size() const;
+
+	// called with each evicted item, and the cls pointer
+	void set_evict_func(void (*func)(T*, void*), void *cls = 0);
+
+	// changing the budget evicts items immediately if necessary
+	void set_max_size(size_t max_size);
+	size_t max_size() const;
+	size_t total_size() const;
+
+	// Inserts item with the given key and size in bytes, as the most recently
+	// used one, and evicts old items if the budget is exceeded (never the one
+	// just inserted). If another item with the same key was already in the
+	// cache, it's removed without calling the evict function, and returned.
+	// Inserting an item which is already in the cache moves it to the new key
+	// and size, and returns null if it was the one under that key.
+	T *insert(T *item, const K &key, size_t size);
+	// find marks the item as used, peek doesn't. Return null if not found.
+	T *find(const K &key);
+	T *peek(const K &key) const;
+	void touch(T *item);
+	// remove items without calling the evict function
+	T *remove(const K &key);
+	void remove(T *item);
+
+	// evict the least recently used item, returns false if the cache is empty
+	bool evict();
+	// evict items until the total size is at most max_size
+	void shrink(size_t max_size);
+
+	// the LRU list, from the least to the most recently used item
+	InListNode<T> *oldest() const;
+	InListNode<T> *newest() const;
+};
+
+#ifdef INLIST_HAVE_ATOMIC
+// Lock-free intrusive multi-producer, single-consumer queue (Vyukov's MPSC
+// node queue), for passing objects between threads without allocating: items
+// embed an InQueueNode at offset offs, and must stay alive until popped.
+// push can be called from any number of threads and never blocks or waits
+// for the consumer. pop must only be called from one thread at a time; it
+// returns null when the queue is empty, and also briefly while a producer is
+// in the middle of a push, in which case the consumer should just try again
+// later. Items come out in FIFO order per producer.
+// Needs C++11.
+template <typename T>
+class InQueueNode {
+public:
+	std::atomic<InQueueNode<T>*> next;
+
+	InQueueNode();
+};
+
+template <typename T, int offs>
+class InMPSCQueue {
+private:
+	// producers and the consumer are kept on separate cache lines
+	std::atomic<InQueueNode<T>*> headp;	// last pushed
+	char pad0[64 - sizeof(std::atomic<InQueueNode<T>*>)];
+	InQueueNode<T> *tailp;		// next to pop, consumer only
+	InQueueNode<T> stub;
+	char pad1[64];
+
+	void push_node(InQueueNode<T> *node);
+	T *item(InQueueNode<T> *node) const;
+
+	InMPSCQueue(const InMPSCQueue&);
+	InMPSCQueue &operator =(const InMPSCQueue&);
+
+public:
+	InMPSCQueue();
+
+	void push(T *item);
+	T *pop();
+	// consumer only, false positives while a producer is mid-push
+	bool empty() const;
+};
+#endif	// INLIST_HAVE_ATOMIC
+
 // ---- InListNode implementation ----
 template <typename T>
 InListNode<T>::InListNode()
@@ -159,4 +312,371 @@ InListNode<T> *InList<T,offs>::tail() const
 	return tailp;
 }
 
+// ---- InHash implementation ----
+// FNV-1a
+template <typename K>
+unsigned int InHash<K>::hash(const K &key)
+{
+	const unsigned char *p = (const unsigned char*)&key;
+	unsigned int h = 2166136261u;
+	for(size_t i=0; i<sizeof key; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+template <typename K>
+bool InHash<K>::equal(const K &a, const K &b)
+{
+	return a == b;
+}
+
+template <>
+inline unsigned int InHash<const char*>::hash(const char * const &key)
+{
+	const unsigned char *p = (const unsigned char*)key;
+	unsigned int h = 2166136261u;
+	while(*p) {
+		h = (h ^ *p++) * 16777619u;
+	}
+	return h;
+}
+
+template <>
+inline bool InHash<const char*>::equal(const char * const &a, const char * const &b)
+{
+	return strcmp(a, b) == 0;
+}
+
+// ---- InCacheNode implementation ----
+template <typename T, typename K>
+InCacheNode<T,K>::InCacheNode()
+{
+	size = 0;
+	hash = 0;
+	hnext = 0;
+}
+
+// ---- InCache implementation ----
+template <typename T, typename K, int offs, typename H>
+InCache<T,K,offs,H>::InCache(size_t max_size)
+{
+	buckets = 0;
+	nbuckets = 0;
+	total_sz = 0;
+	max_sz = max_size;
+	evict_func = 0;
+	evict_cls = 0;
+}
+
+template <typename T, typename K, int offs, typename H>
+InCache<T,K,offs,H>::~InCache()
+{
+	clear();
+	delete [] buckets;
+}
+
+template <typename T, typename K, int offs, typename H>
+InCacheNode<T,K> *InCache<T,K,offs,H>::node(T *item) const
+{
+	return (InCacheNode<T,K>*)((char*)item + offs);
+}
+
+template <typename T, typename K, int offs, typename H>
+InCacheNode<T,K> *InCache<T,K,offs,H>::lookup(const K &key) const
+{
+	if(!nbuckets) return 0;
+
+	unsigned int h = H::hash(key);
+	InCacheNode<T,K> *n = buckets[h & (nbuckets - 1)];
+	while(n) {
+		if(n->hash == h && H::equal(n->key, key)) {
+			return n;
+		}
+		n = n->hnext;
+	}
+	return 0;
+}
+
+// items are only ever linked in the LRU list while they're in the cache
+template <typename T, typename K, int offs, typename H>
+bool InCache<T,K,offs,H>::cached(InCacheNode<T,K> *n) const
+{
+	return n->lnode.prev || n->lnode.next || lru.head() == &n->lnode;
+}
+
+template <typename T, typename K, int offs, typename H>
+void InCache<T,K,offs,H>::unhash(InCacheNode<T,K> *n)
+{
+	InCacheNode<T,K> **link = buckets + (n->hash & (nbuckets - 1));
+	while(*link != n) {
+		link = &(*link)->hnext;
+	}
+	*link = n->hnext;
+	n->hnext = 0;
+}
+
+template <typename T, typename K, int offs, typename H>
+void InCache<T,K,offs,H>::rehash(unsigned int count)
+{
+	InCacheNode<T,K> **newb = new InCacheNode<T,K>*[count]();
+
+	for(unsigned int i=0; i<nbuckets; i++) {
+		InCacheNode<T,K> *n = buckets[i];
+		while(n) {
+			InCacheNode<T,K> *next = n->hnext;
+			InCacheNode<T,K> **b = newb + (n->hash & (count - 1));
+			n->hnext = *b;
+			*b = n;
+			n = next;
+		}
+	}
+	delete [] buckets;
+	buckets = newb;
+	nbuckets = count;
+}
+
+template <typename T, typename K, int offs, typename H>
+void InCache<T,K,offs,H>::clear()
+{
+	for(unsigned int i=0; i<nbuckets; i++) {
+		InCacheNode<T,K> *n = buckets[i];
+		while(n) {
+			InCacheNode<T,K> *next = n->hnext;
+			n->hnext = 0;
+			n = next;
+		}
+		buckets[i] = 0;
+	}
+	lru.clear();
+	total_sz = 0;
+}
+
+template <typename T, typename K, int offs, typename H>
+bool InCache<T,K,offs,H>::empty() const
+{
+	return lru.empty();
+}
+
+template <typename T, typename K, int offs, typename H>
+int InCache<T,K,offs,H>::size() const
+{
+	return lru.size();
+}
+
+template <typename T, typename K, int offs, typename H>
+void InCache<T,K,offs,H>::set_evict_func(void (*func)(T*, void*), void *cls)
+{
+	evict_func = func;
+	evict_cls = cls;
+}
+
+template <typename T, typename K, int offs, typename H>
+void InCache<T,K,offs,H>::set_max_size(size_t max_size)
+{
+	max_sz = max_size;
+	if(max_sz) {
+		shrink(max_sz);
+	}
+}
+
+template <typename T, typename K, int offs, typename H>
+size_t InCache<T,K,offs,H>::max_size() const
+{
+	return max_sz;
+}
+
+template <typename T, typename K, int offs, typename H>
+size_t InCache<T,K,offs,H>::total_size() const
+{
+	return total_sz;
+}
+
+template <typename T, typename K, int offs, typename H>
+T *InCache<T,K,offs,H>::insert(T *item, const K &key, size_t size)
+{
+	InCacheNode<T,K> *n = node(item);
+	if(cached(n)) {
+		remove(item);	// re-keyed, or re-inserted under the same key
+	}
+	T *prev = remove(key);
+
+	if((unsigned int)lru.size() >= nbuckets) {
+		rehash(nbuckets ? nbuckets * 2 : 16);
+	}
+
+	n->key = key;
+	n->size = size;
+	n->hash = H::hash(key);
+
+	InCacheNode<T,K> **b = buckets + (n->hash & (nbuckets - 1));
+	n->hnext = *b;
+	*b = n;
+
+	lru.append(item);
+	total_sz += size;
+
+	if(max_sz) {
+		while(total_sz > max_sz && lru.head() != &n->lnode) {
+			evict();
+		}
+	}
+	return prev;
+}
+
+template <typename T, typename K, int offs, typename H>
+T *InCache<T,K,offs,H>::find(const K &key)
+{
+	InCacheNode<T,K> *n = lookup(key);
+	if(!n) return 0;
+
+	touch(n->lnode.item);
+	return n->lnode.item;
+}
+
+template <typename T, typename K, int offs, typename H>
+T *InCache<T,K,offs,H>::peek(const K &key) const
+{
+	InCacheNode<T,K> *n = lookup(key);
+	return n ? n->lnode.item : 0;
+}
+
+template <typename T, typename K, int offs, typename H>
+void InCache<T,K,offs,H>::touch(T *item)
+{
+	if(lru.tail() != &node(item)->lnode) {
+		lru.unlink(item);
+		lru.append(item);
+	}
+}
+
+template <typename T, typename K, int offs, typename H>
+T *InCache<T,K,offs,H>::remove(const K &key)
+{
+	InCacheNode<T,K> *n = lookup(key);
+	if(!n) return 0;
+
+	T *item = n->lnode.item;
+	remove(item);
+	return item;
+}
+
+template <typename T, typename K, int offs, typename H>
+void InCache<T,K,offs,H>::remove(T *item)
+{
+	InCacheNode<T,K> *n = node(item);
+	unhash(n);
+	lru.unlink(item);
+	total_sz -= n->size;
+}
+
+template <typename T, typename K, int offs, typename H>
+bool InCache<T,K,offs,H>::evict()
+{
+	if(lru.empty()) return false;
+
+	T *item = lru.head()->item;
+	remove(item);
+	if(evict_func) {
+		evict_func(item, evict_cls);
+	}
+	return true;
+}
+
+template <typename T, typename K, int offs, typename H>
+void InCache<T,K,offs,H>::shrink(size_t max_size)
+{
+	while(total_sz > max_size && evict());
+}
+
+template <typename T, typename K, int offs, typename H>
+InListNode<T> *InCache<T,K,offs,H>::oldest() const
+{
+	return lru.head();
+}
+
+template <typename T, typename K, int offs, typename H>
+InListNode<T> *InCache<T,K,offs,H>::newest() const
+{
+	return lru.tail();
+}
+
+#ifdef INLIST_HAVE_ATOMIC
+// ---- InQueueNode implementation ----
+template <typename T>
+InQueueNode<T>::InQueueNode()
+{
+	next.store(0, std::memory_order_relaxed);
+}
+
+// ---- InMPSCQueue implementation ----
+// headp is the most recently pushed node, and every node points to the one
+// pushed after it. The stub node keeps the list non-empty, so that push never
+// needs to touch tailp: it's re-pushed whenever the consumer is about to take
+// the last node.
+template <typename T, int offs>
+InMPSCQueue<T,offs>::InMPSCQueue()
+{
+	headp.store(&stub, std::memory_order_relaxed);
+	tailp = &stub;
+}
+
+template <typename T, int offs>
+T *InMPSCQueue<T,offs>::item(InQueueNode<T> *node) const
+{
+	return (T*)((char*)node - offs);
+}
+
+template <typename T, int offs>
+void InMPSCQueue<T,offs>::push_node(InQueueNode<T> *node)
+{
+	node->next.store(0, std::memory_order_relaxed);
+	InQueueNode<T> *prev = headp.exchange(node, std::memory_order_acq_rel);
+	// between the exchange and this store, the list is broken at prev, and
+	// the consumer can't get past it
+	prev->next.store(node, std::memory_order_release);
+}
+
+template <typename T, int offs>
+void InMPSCQueue<T,offs>::push(T *item)
+{
+	push_node((InQueueNode<T>*)((char*)item + offs));
+}
+
+template <typename T, int offs>
+T *InMPSCQueue<T,offs>::pop()
+{
+	InQueueNode<T> *tail = tailp;
+	InQueueNode<T> *next = tail->next.load(std::memory_order_acquire);
+
+	if(tail == &stub) {
+		if(!next) return 0;
+		tailp = tail = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+	if(next) {
+		tailp = next;
+		return item(tail);
+	}
+
+	if(tail != headp.load(std::memory_order_acquire)) {
+		return 0;	// a push is in progress
+	}
+	// tail is the last node, put the stub back behind it before taking it
+	push_node(&stub);
+	next = tail->next.load(std::memory_order_acquire);
+	if(next) {
+		tailp = next;
+		return item(tail);
+	}
+	return 0;
+}
+
+template <typename T, int offs>
+bool InMPSCQueue<T,offs>::empty() const
+{
+	return tailp == &stub && !stub.next.load(std::memory_order_acquire);
+}
+#endif	// INLIST_HAVE_ATOMIC
+
 #endif	/* INTRUSIVE_LINKED_LIST_H_ */
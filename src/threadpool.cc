@@ -1,33 +1,108 @@
 #include <algorithm>
 #include <chrono>
+#include <system_error>
 #include "threadpool.h"
 
 using namespace std::chrono;
 
-ThreadPool::ThreadPool(int num_threads)
+// number of times an idle worker polls the queue before parking
+#define IDLE_SPIN_COUNT		256
+// a non-empty priority level which has been passed over this many times in a
+// row gets to run the next job
+#define STARVE_LIMIT		16
+
+// worker thread index, for picking the right statistics counters
+static thread_local const ThreadPool *tls_pool;
+static thread_local int tls_thread_idx;
+
+static inline unsigned long long usec_now()
+{
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void hist_add(std::atomic<unsigned long> *hist, unsigned long long usec)
+{
+	int bin = 0;
+	while(usec && bin < ThreadPool::HIST_BINS - 1) {
+		usec >>= 1;
+		bin++;
+	}
+	hist[bin].fetch_add(1, std::memory_order_relaxed);
+}
+
+static inline void cpu_relax()
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	__builtin_ia32_pause();
+#endif
+}
+
+ThreadPool::ThreadPool(int num_threads, int queue_size)
+{
+	elastic = false;
+	init(num_threads, num_threads, queue_size);
+}
+
+ThreadPool::ThreadPool(const ElasticParams &params, int queue_size)
+{
+	elastic = true;
+	queue_wait = std::max(params.queue_wait, milliseconds(1));
+	idle_time = params.idle_time;
+	init(params.min_threads, params.max_threads, queue_size);
+}
+
+void ThreadPool::init(int min_threads, int num_threads, int queue_size)
 {
 	quit = false;
 	qsize = 0;
+	for(int i=0; i<NUM_PRIO; i++) {
+		workq[i].init(queue_size);
+		qsize_prio[i] = 0;
+		starve[i] = 0;
+	}
 	nactive = 0;
+	nidle = 0;
+	nwaiters = 0;
+	stats_enabled = false;
+	next_timer_id = 0;
+	timer_quit = false;
+	nlive = 0;
+	sup_sleeping = false;
 
 	if(num_threads == -1) {
-		num_threads = std::thread::hardware_concurrency();
+		// hardware_concurrency returns 0 if it can't tell
+		num_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+	}
+	if(!elastic) {
+		min_threads = num_threads;	// nothing to grow a fixed pool later
+	}
+	this->num_threads = num_threads;
+	this->min_threads = min_threads = std::min(std::max(min_threads, 1), num_threads);
+
+	tstats = new StatCounters[num_threads + 1];
+	for(int i=0; i<=num_threads; i++) {
+		tstats[i].threads.store(0, std::memory_order_relaxed);
 	}
+	reset_stats();
 
-	printf("creating thread pool with %d threads\n", num_threads);
+	if(elastic) {
+		printf("creating elastic thread pool with %d-%d threads\n", min_threads, num_threads);
+	} else {
+		printf("creating thread pool with %d threads\n", num_threads);
+	}
 
 	thread = new std::thread[num_threads];
-	for(int i=0; i<num_threads; i++) {
-		thread[i] = std::thread(&ThreadPool::thread_func, this);
+	slot_state.assign(num_threads, SLOT_UNUSED);
+	{
+		std::unique_lock<std::mutex> lock(workq_mutex);
+		for(int i=0; i<min_threads; i++) {
+			start_worker();
+		}
+	}
 
-#ifdef _MSC_VER
-		/* detach the thread to avoid having to join them in the destructor, which
-		 * causes a deadlock in msvc implementation when called after main returns
-		 */
-		thread[i].detach();
-#endif
+	if(elastic) {
+		supervisor = std::thread(&ThreadPool::supervisor_func, this);
 	}
-	this->num_threads = num_threads;
 }
 
 ThreadPool::~ThreadPool()
@@ -36,69 +111,350 @@ ThreadPool::~ThreadPool()
 	clear_work();
 #endif
 
-	quit = true;
-	workq_condvar.notify_all();
+	if(timer_thread.joinable()) {
+		{
+			std::unique_lock<std::mutex> lock(timer_mutex);
+			timer_quit = true;
+			timer_condvar.notify_all();
+		}
+		timer_thread.join();
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(workq_mutex);
+		quit = true;
+		workq_condvar.notify_all();
+		sup_condvar.notify_all();
+	}
+	// the supervisor has to be out of the way before the workers are joined,
+	// so that it can't start new ones
+	if(supervisor.joinable()) {
+		supervisor.join();
+	}
 
-	printf("ThreadPool: waiting for %d worker threads to stop ", num_threads);
+	printf("ThreadPool: waiting for %d worker threads to stop ", (int)nlive);
 	fflush(stdout);
 #ifndef _MSC_VER
 	for(int i=0; i<num_threads; i++) {
+		if(slot_state[i] == SLOT_UNUSED) continue;
 		thread[i].join();
-		putchar('.');
-		fflush(stdout);
+		if(slot_state[i] == SLOT_RUNNING) {
+			putchar('.');
+			fflush(stdout);
+		}
 	}
 #else
 	// spin until all threads are done...
-	std::unique_lock<std::mutex> lock(workq_mutex);
 	while(nactive > 0) {
-		lock.unlock();
 		std::this_thread::sleep_for(std::chrono::milliseconds(128));
 		putchar('.');
 		fflush(stdout);
-		lock.lock();
 	}
 #endif	// _MSC_VER
 
 	putchar('\n');
 	delete [] thread;
+	delete [] tstats;
+}
+
+ThreadPool::Job ThreadPool::make_job(std::function<void ()> &&work_func,
+		std::function<void ()> &&done_func)
+{
+	if(!done_func) {
+		return Job(std::move(work_func));
+	}
+	static_assert(sizeof(WorkDone) <= Job::INLINE_SIZE, "WorkDone doesn't fit in a Job");
+	static_assert(std::is_nothrow_move_constructible<Job>::value,
+			"Job must be nothrow-movable, to be stored inline by other jobs and moved by containers");
+	return Job(WorkDone{std::move(work_func), std::move(done_func)});
 }
 
 void ThreadPool::add_work(std::function<void ()> func)
 {
-	add_work(func, std::function<void ()>{});
+	push_work(PRIO_NORMAL, WorkItem{Job(std::move(func)), 0});
 }
 
 void ThreadPool::add_work(std::function<void ()> work_func, std::function<void ()> done_func)
 {
-	std::unique_lock<std::mutex> lock(workq_mutex);
-	workq.push_back(WorkItem{work_func, done_func});
-	++qsize;
-	workq_condvar.notify_all();
+	push_work(PRIO_NORMAL, WorkItem{make_job(std::move(work_func), std::move(done_func)), 0});
+}
+
+void ThreadPool::add_work(const CancelToken &token, std::function<void ()> work_func,
+		std::function<void (bool)> done_func)
+{
+	static_assert(sizeof(WorkCancel) <= Job::INLINE_SIZE, "WorkCancel doesn't fit in a Job");
+	push_work(PRIO_NORMAL, WorkItem{Job(WorkCancel{token, std::move(work_func),
+			std::move(done_func)}), 0});
+}
+
+void ThreadPool::add_work_prio(int prio, std::function<void ()> work_func,
+		std::function<void ()> done_func)
+{
+	prio = std::min(std::max(prio, 0), (int)NUM_PRIO - 1);
+	push_work(prio, WorkItem{make_job(std::move(work_func), std::move(done_func)), 0});
+}
+
+void ThreadPool::push_work(int prio, WorkItem &&witem)
+{
+	if(elastic || stats_enabled.load(std::memory_order_relaxed)) {
+		witem.tenq = usec_now();
+	}
+
+	while(!workq[prio].push(std::move(witem))) {
+		// queue is full. Workers make progress by running a job themselves,
+		// or they could deadlock adding work; any other thread (the timer
+		// thread, or callers which may be holding their own locks) waits for
+		// the workers to make room.
+		if(tls_pool != this || !run_one()) {
+			std::this_thread::yield();
+		}
+	}
+
+	// only count it once it's in the queue, so that parked workers don't wake
+	// up for it while we're still waiting for room. A worker may have popped
+	// it already, and taken qsize below zero for a moment, in which case a
+	// waiter may have gone back to sleep on pending() < 0.
+	++qsize_prio[prio];
+	if(++qsize <= 0 && nwaiters > 0) {
+		std::unique_lock<std::mutex> lock(workq_mutex);
+		done_condvar.notify_all();
+	}
+
+	// qsize was incremented before reading nidle, and parking workers
+	// increment nidle before checking qsize, so a wakeup can't be lost.
+	if(nidle > 0) {
+		std::unique_lock<std::mutex> lock(workq_mutex);
+		workq_condvar.notify_one();
+	}
+
+	// same handshake with the supervisor, which parks with an empty queue
+	if(elastic && sup_sleeping) {
+		std::unique_lock<std::mutex> lock(workq_mutex);
+		if(sup_sleeping) {
+			sup_sleeping = false;
+			sup_condvar.notify_one();
+		}
+	}
+}
+
+ThreadPool::TaskHandle ThreadPool::add_task(std::function<void ()> work_func,
+		std::function<void ()> done_func)
+{
+	return add_task(std::vector<TaskHandle>{}, std::move(work_func), std::move(done_func));
+}
+
+ThreadPool::TaskHandle ThreadPool::add_task(const std::vector<TaskHandle> &deps,
+		std::function<void ()> work_func, std::function<void ()> done_func)
+{
+	TaskHandle handle;
+	handle.st = std::make_shared<TaskState>();
+
+	TaskState *ts = handle.st.get();
+	ts->pool = this;
+	ts->work = std::move(work_func);
+	ts->done = std::move(done_func);
+	ts->finished = false;
+	ts->dropped = false;
+	ts->self = handle.st;
+
+	// hold an extra dependency while registering with the predecessors, so
+	// that the task can't be submitted by one of them before we're done
+	ts->ndeps = 1;
+
+	for(const TaskHandle &dep : deps) {
+		if(!dep.st) continue;
+		TaskState *dst = dep.st.get();
+
+		std::unique_lock<std::mutex> lock(dst->mutex);
+		if(!dst->finished) {
+			++ts->ndeps;
+			dst->successors.push_back(ts);
+		} else if(dst->dropped) {
+			ts->dropped = true;
+		}
+	}
+
+	if(--ts->ndeps == 0) {
+		submit_task(ts);
+	}
+	return handle;
+}
+
+void ThreadPool::submit_task(TaskState *ts)
+{
+	if(ts->dropped) {
+		ts->finish();
+	} else {
+		add_work(TaskJob(ts));
+	}
+}
+
+ThreadPool::TaskJob::~TaskJob()
+{
+	if(ts) {
+		ts->dropped = true;
+		ts->finish();
+	}
+}
+
+void ThreadPool::TaskJob::operator ()()
+{
+	TaskState *tmp = ts;
+	ts = 0;
+	tmp->run();
+}
+
+int ThreadPool::add_work_after(steady_clock::duration delay, std::function<void ()> func)
+{
+	return add_timer(delay, steady_clock::duration::zero(), std::move(func));
+}
+
+int ThreadPool::add_work_every(steady_clock::duration period, std::function<void ()> func)
+{
+	return add_timer(period, std::max(period, steady_clock::duration(1)), std::move(func));
+}
+
+int ThreadPool::add_timer(steady_clock::duration delay, steady_clock::duration period,
+		std::function<void ()> &&func)
+{
+	std::shared_ptr<TimerState> st = std::make_shared<TimerState>();
+	st->func = std::move(func);
+	st->period = period;
+	st->cancelled = false;
+	st->running = false;
+
+	std::unique_lock<std::mutex> lock(timer_mutex);
+	if(!timer_thread.joinable()) {
+		timer_thread = std::thread(&ThreadPool::timer_func, this);
+	}
+
+	TimerEntry te;
+	te.deadline = steady_clock::now() + delay;
+	te.id = ++next_timer_id;
+	te.st = std::move(st);
+
+	// only wake up the timer thread if the earliest deadline changed
+	bool wake = timers.empty() || te.deadline < timers.front().deadline;
+	timers.push_back(std::move(te));
+	std::push_heap(timers.begin(), timers.end());
+
+	if(wake) {
+		timer_condvar.notify_one();
+	}
+	return next_timer_id;
+}
+
+bool ThreadPool::cancel_timer(int id)
+{
+	std::unique_lock<std::mutex> lock(timer_mutex);
+	for(size_t i=0; i<timers.size(); i++) {
+		if(timers[i].id == id) {
+			timers[i].st->cancelled = true;
+			timers.erase(timers.begin() + i);
+			std::make_heap(timers.begin(), timers.end());
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::timer_func()
+{
+	// the running flag is cleared when the job is destroyed, rather than after
+	// it runs, so that a job dropped by clear_work doesn't block the timer
+	struct TimerJob {
+		std::shared_ptr<TimerState> st;
+
+		TimerJob(const std::shared_ptr<TimerState> &st) : st(st) {}
+		TimerJob(TimerJob &&job) noexcept : st(std::move(job.st)) {}
+		~TimerJob()
+		{
+			if(st) st->running = false;
+		}
+
+		void operator ()()
+		{
+			if(!st->cancelled) {
+				st->func();
+			}
+		}
+	};
+
+	std::unique_lock<std::mutex> lock(timer_mutex);
+
+	while(!timer_quit) {
+		if(timers.empty()) {
+			timer_condvar.wait(lock);
+			continue;
+		}
+
+		steady_clock::time_point now = steady_clock::now();
+		if(timers.front().deadline > now) {
+			timer_condvar.wait_until(lock, timers.front().deadline);
+			continue;
+		}
+
+		std::pop_heap(timers.begin(), timers.end());
+		TimerEntry te = std::move(timers.back());
+		timers.pop_back();
+
+		std::shared_ptr<TimerState> st = te.st;
+		if(st->period != steady_clock::duration::zero()) {
+			// reschedule on the original grid, skipping any periods we missed
+			do {
+				te.deadline += st->period;
+			} while(te.deadline <= now);
+			timers.push_back(std::move(te));
+			std::push_heap(timers.begin(), timers.end());
+		}
+
+		if(st->running.exchange(true)) {
+			continue;	// previous run hasn't finished
+		}
+
+		// add_work may wait for room if the queue is full, don't hold the
+		// timer lock meanwhile
+		lock.unlock();
+		add_work(TimerJob(st));
+		lock.lock();
+	}
 }
 
 void ThreadPool::clear_work()
 {
-	std::unique_lock<std::mutex> lock(workq_mutex);
-	workq.clear();
-	qsize = 0;
+	WorkItem witem;
+	for(int i=0; i<NUM_PRIO; i++) {
+		while(workq[i].pop(witem)) {
+			--qsize_prio[i];
+			--qsize;
+		}
+	}
 }
 
 int ThreadPool::queued() const
 {
-	std::unique_lock<std::mutex> lock(workq_mutex);
-	return qsize;
+	return std::max((int)qsize, 0);
+}
+
+int ThreadPool::queued(int prio) const
+{
+	if(prio < 0 || prio >= NUM_PRIO) {
+		return 0;
+	}
+	return std::max((int)qsize_prio[prio], 0);
 }
 
 int ThreadPool::active() const
 {
-	std::unique_lock<std::mutex> lock(workq_mutex);
 	return nactive;
 }
 
 int ThreadPool::pending() const
 {
-	std::unique_lock<std::mutex> lock(workq_mutex);
-	return nactive + qsize;
+	// workers count a job as active before removing it from qsize, so reading
+	// qsize first never misses a job in transit
+	int res = qsize;
+	return res + nactive;
 }
 
 long ThreadPool::wait()
@@ -106,7 +462,9 @@ long ThreadPool::wait()
 	auto start_time = steady_clock::now();
 
 	std::unique_lock<std::mutex> lock(workq_mutex);
-	done_condvar.wait(lock, [this](){ return nactive == 0 && workq.empty(); });
+	++nwaiters;
+	done_condvar.wait(lock, [this](){ return pending() == 0; });
+	--nwaiters;
 
 	auto dur = steady_clock::now() - start_time;
 	return duration_cast<milliseconds>(dur).count();
@@ -118,41 +476,707 @@ long ThreadPool::wait(long timeout)
 	duration<long, std::milli> dur, timeout_dur(std::max(timeout, 5L));
 
 	std::unique_lock<std::mutex> lock(workq_mutex);
-	while(timeout_dur.count() > 0 && (nactive > 0 || !workq.empty())) {
+	++nwaiters;
+	while(timeout_dur.count() > 0 && pending() > 0) {
 		if(done_condvar.wait_for(lock, timeout_dur) == std::cv_status::timeout) {
 			break;
 		}
 		dur = duration_cast<milliseconds>(steady_clock::now() - start_time);
 		timeout_dur = milliseconds(std::max(timeout, 5L)) - dur;
 	}
+	--nwaiters;
+	dur = duration_cast<milliseconds>(steady_clock::now() - start_time);
 
-	/*printf("waited for: %ld ms (%ld req) (na %d,qs %d,em %s)\n", dur.count(), timeout,
-			nactive, qsize, workq.empty() ? "true" : "false");*/
+	/*printf("waited for: %ld ms (%ld req) (na %d,qs %d)\n", dur.count(), timeout,
+			nactive.load(), qsize.load());*/
 	return dur.count();
 }
 
-void ThreadPool::thread_func()
+// expects the job to already be counted in nactive
+void ThreadPool::run_work(WorkItem &witem)
+{
+	StatCounters *st = 0;
+	unsigned long long t0 = 0;
+
+	if(stats_enabled.load(std::memory_order_relaxed)) {
+		st = tstats + (tls_pool == this ? tls_thread_idx : num_threads);
+		t0 = usec_now();
+		if(witem.tenq) {
+			hist_add(st->wait_hist, t0 > witem.tenq ? t0 - witem.tenq : 0);
+		}
+	}
+
+	witem.job();
+
+	if(st) {
+		unsigned long long t = usec_now() - t0;
+		st->jobs.fetch_add(1, std::memory_order_relaxed);
+		st->busy_us.fetch_add(t, std::memory_order_relaxed);
+		hist_add(st->exec_hist, t);
+	}
+
+	--nactive;
+	// only take the lock to notify if someone is actually waiting
+	if(nwaiters > 0) {
+		std::unique_lock<std::mutex> lock(workq_mutex);
+		done_condvar.notify_all();
+	}
+}
+
+// pops the next job to run, by priority, and counts it as active
+bool ThreadPool::pop_work(WorkItem &witem)
+{
+	int prio = -1;
+
+	// starvation protection takes precedence over priority order
+	for(int i=NUM_PRIO-1; i>0; i--) {
+		if(starve[i].load(std::memory_order_relaxed) >= STARVE_LIMIT && qsize_prio[i] > 0) {
+			if(workq[i].pop(witem)) {
+				prio = i;
+			}
+			break;
+		}
+	}
+	if(prio == -1) {
+		for(int i=0; i<NUM_PRIO; i++) {
+			if(qsize_prio[i] > 0 && workq[i].pop(witem)) {
+				prio = i;
+				break;
+			}
+		}
+		if(prio == -1) return false;
+	}
+
+	++nactive;
+	--qsize_prio[prio];
+	--qsize;
+
+	// the starvation counters are shared by all workers, and only need to be
+	// approximately right
+	starve[prio].store(0, std::memory_order_relaxed);
+	for(int i=prio+1; i<NUM_PRIO; i++) {
+		if(qsize_prio[i] > 0) {
+			starve[i].fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	return true;
+}
+
+// pops a single job from the queue and runs it on the calling thread
+bool ThreadPool::run_one()
 {
+	WorkItem witem;
+	if(!pop_work(witem)) {
+		return false;
+	}
+	run_work(witem);
+	return true;
+}
+
+// aim for a few chunks per thread, to leave some slack for load balancing
+int ThreadPool::auto_grain(int count) const
+{
+	return std::max(count / (std::max(num_threads, 1) * 8), 1);
+}
+
+// waits for a parallel_for/parallel_reduce to complete, running queued jobs in
+// the meantime. When there's nothing to run, all our remaining pieces are
+// running on other threads: sleep until the last one completes. Any pieces they
+// split off are picked up by them or the other workers.
+void ThreadPool::join(ForkJoin *fj)
+{
+	for(;;) {
+		{
+			std::unique_lock<std::mutex> lock(fj->mutex);
+			if(fj->pending == 0) break;
+		}
+
+		if(!run_one()) {
+			std::unique_lock<std::mutex> lock(fj->mutex);
+			fj->cv.wait(lock, [fj](){ return fj->pending == 0; });
+		}
+	}
+}
+
+ThreadPool::Pipeline::Pipeline(ThreadPool *pool)
+{
+	this->pool = pool;
+	input_done = true;
+	input_seq = 0;
+	ntokens = 0;
+}
+
+void ThreadPool::Pipeline::add_stage(int mode, std::function<void *(void *)> func)
+{
+	Stage st;
+	st.mode = stages.empty() ? SERIAL : mode;
+	st.func = std::move(func);
+	st.next_seq = 0;
+	stages.push_back(std::move(st));
+}
+
+void ThreadPool::Pipeline::run(int max_tokens)
+{
+	if(stages.empty()) return;
+
+	if(max_tokens <= 0) {
+		max_tokens = pool->num_threads * 2;
+	}
+
+	input_done = false;
+	input_seq = 0;
+	for(Stage &st : stages) {
+		st.next_seq = 0;
+		st.waiting.clear();
+	}
+	ntokens = max_tokens;
+
+	// each token pulls an item from the input and carries it through the
+	// stages, then goes back for the next one. The calling thread gets one.
+	for(int i=1; i<max_tokens; i++) {
+		pool->add_work([this]() { run_token(Item{0, 0}, 0); });
+	}
+	run_token(Item{0, 0}, 0);
+
+	// same reasoning as ThreadPool::join
+	for(;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if(ntokens == 0) break;
+		}
+
+		if(!pool->run_one()) {
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this](){ return ntokens == 0; });
+		}
+	}
+}
+
+// carries item through the stages starting from first_stage, and then keeps
+// processing new input until it runs out. Returns early if the item has to
+// wait for its turn at a serial stage: the token is then resumed, in a new
+// job, by whoever finishes the item before it.
+void ThreadPool::Pipeline::run_token(Item item, size_t first_stage)
+{
+	for(;;) {
+		if(first_stage == 0) {
+			std::unique_lock<std::mutex> lock(input_mutex);
+			if(input_done || !(item.data = stages[0].func(0))) {
+				input_done = true;
+				break;
+			}
+			item.seq = input_seq++;
+			first_stage = 1;
+		}
+
+		for(size_t i=first_stage; i<stages.size(); i++) {
+			Stage &st = stages[i];
+
+			if(st.mode == SERIAL) {
+				std::unique_lock<std::mutex> lock(mutex);
+				if(item.seq != st.next_seq) {
+					st.waiting.push_back(item);
+					std::push_heap(st.waiting.begin(), st.waiting.end());
+					return;
+				}
+			}
+
+			// dropped items still have to go through the serial stages in
+			// order, to let the ones after them through
+			if(item.data) {
+				item.data = st.func(item.data);
+			}
+
+			if(st.mode == SERIAL) {
+				bool resume = false;
+				Item next;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					++st.next_seq;
+					if(!st.waiting.empty() && st.waiting.front().seq == st.next_seq) {
+						std::pop_heap(st.waiting.begin(), st.waiting.end());
+						next = st.waiting.back();
+						st.waiting.pop_back();
+						resume = true;
+					}
+				}
+				if(resume) {
+					pool->add_work([this, next, i]() { run_token(next, i); });
+				}
+			}
+		}
+		first_stage = 0;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	if(--ntokens == 0) {
+		cv.notify_all();
+	}
+}
+
+void ThreadPool::TaskState::run()
+{
+	work();
+	if(done) {
+		done();
+	}
+	finish();
+}
+
+// marks the task finished and releases the successors which were waiting for
+// it. Dropped successors finish right here, without running: that's done in a
+// loop rather than recursively, since dropping a long chain of tasks could
+// otherwise overflow the stack.
+void ThreadPool::TaskState::finish()
+{
+	ThreadPool *pool = this->pool;
+	std::vector<TaskState*> todo(1, this);
+
+	while(!todo.empty()) {
+		TaskState *ts = todo.back();
+		todo.pop_back();
+
+		// release the captured state
+		ts->work = nullptr;
+		ts->done = nullptr;
+
+		std::vector<TaskState*> succ;
+		{
+			std::unique_lock<std::mutex> lock(ts->mutex);
+			ts->finished = true;
+			succ.swap(ts->successors);
+			ts->cv.notify_all();
+		}
+
+		for(TaskState *s : succ) {
+			if(ts->dropped) {
+				s->dropped = true;
+			}
+			if(--s->ndeps == 0) {
+				if(s->dropped) {
+					todo.push_back(s);
+				} else {
+					pool->submit_task(s);
+				}
+			}
+		}
+
+		// drop the queue's reference; this might be the last one
+		std::shared_ptr<TaskState> tmp;
+		tmp.swap(ts->self);
+	}
+}
+
+bool ThreadPool::TaskHandle::valid() const
+{
+	return (bool)st;
+}
+
+bool ThreadPool::TaskHandle::finished() const
+{
+	if(!st) return true;
+	std::unique_lock<std::mutex> lock(st->mutex);
+	return st->finished;
+}
+
+bool ThreadPool::TaskHandle::dropped() const
+{
+	return st && st->dropped;
+}
+
+void ThreadPool::TaskHandle::wait() const
+{
+	if(!st) return;
+
+	for(;;) {
+		{
+			std::unique_lock<std::mutex> lock(st->mutex);
+			if(st->finished) break;
+		}
+
+		// same reasoning as ThreadPool::join
+		if(!st->pool->run_one()) {
+			std::unique_lock<std::mutex> lock(st->mutex);
+			st->cv.wait(lock, [this](){ return st->finished; });
+		}
+	}
+}
+
+void ThreadPool::ForkJoin::done()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if(--pending == 0) {
+		cv.notify_all();
+	}
+}
+
+void ThreadPool::ForkJoin::fail(std::exception_ptr e)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if(!error) {
+		error = e;
+	}
+}
+
+void ThreadPool::thread_func(int id)
+{
+	WorkItem witem;
+
+	tls_pool = this;
+	tls_thread_idx = id;
+
+	while(!quit) {
+		bool found = false;
+		for(int i=0; i<IDLE_SPIN_COUNT; i++) {
+			if(pop_work(witem)) {
+				found = true;
+				break;
+			}
+			if(quit) return;
+			cpu_relax();
+		}
+
+		if(found) {
+			run_work(witem);
+			witem.job.reset();	// release the captured state right away
+			continue;
+		}
+
+		// nothing showed up while spinning, park until add_work wakes us
+		unsigned long long t0 = stats_enabled.load(std::memory_order_relaxed) ? usec_now() : 0;
+
+		std::unique_lock<std::mutex> lock(workq_mutex);
+		bool retire = false;
+		++nidle;
+		if(!elastic) {
+			workq_condvar.wait(lock, [this](){ return quit || qsize > 0; });
+		} else {
+			while(!quit && qsize <= 0) {
+				if(workq_condvar.wait_for(lock, idle_time) == std::cv_status::timeout &&
+						!quit && qsize <= 0) {
+					// only the top worker may exit, to keep the live ones
+					// contiguous; the others retire after it, one by one
+					if(id == nlive - 1 && nlive > min_threads) {
+						retire = true;
+						break;
+					}
+				}
+			}
+		}
+		--nidle;
+
+		if(retire) {
+			// joined by whoever reuses the slot, or the destructor
+			slot_state[id] = SLOT_EXITED;
+			nlive = id;
+			StatCounters *st = tstats + id;
+			st->threads.store(0, std::memory_order_relaxed);
+			st->retired.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		lock.unlock();
+
+		if(t0) {
+			StatCounters *st = tstats + id;
+			st->idle_us.fetch_add(usec_now() - t0, std::memory_order_relaxed);
+			st->wakeups.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+// starts a worker in the first free slot. Called with workq_mutex held.
+bool ThreadPool::start_worker()
+{
+	int idx = nlive;
+	if(idx >= num_threads) {
+		return false;
+	}
+#ifndef _MSC_VER
+	if(slot_state[idx] == SLOT_EXITED) {
+		thread[idx].join();		// already out of thread_func, won't block long
+	}
+#endif
+
+	try {
+		thread[idx] = std::thread(&ThreadPool::thread_func, this, idx);
+	}
+	catch(const std::system_error&) {
+		slot_state[idx] = SLOT_UNUSED;
+		return false;
+	}
+#ifdef _MSC_VER
+	/* detach the thread to avoid having to join them in the destructor, which
+	 * causes a deadlock in msvc implementation when called after main returns
+	 */
+	thread[idx].detach();
+#endif
+
+	slot_state[idx] = SLOT_RUNNING;
+	nlive = idx + 1;
+
+	StatCounters *st = tstats + idx;
+	st->threads.store(1, std::memory_order_relaxed);
+	st->spawned.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+// enqueue time of the oldest job at the head of any priority queue, 0 if none
+unsigned long long ThreadPool::oldest_queued() const
+{
+	unsigned long long oldest = 0;
+	for(int i=0; i<NUM_PRIO; i++) {
+		unsigned long long t = workq[i].head_time();
+		if(t && (!oldest || t < oldest)) {
+			oldest = t;
+		}
+	}
+	return oldest;
+}
+
+void ThreadPool::supervisor_func()
+{
+	unsigned long long max_wait = duration_cast<microseconds>(queue_wait).count();
+
 	std::unique_lock<std::mutex> lock(workq_mutex);
 	while(!quit) {
-		workq_condvar.wait(lock);
+		// nothing to watch over with an empty queue, sleep until push_work
+		// wakes us up. It sees sup_sleeping set before we check qsize.
+		sup_sleeping = true;
+		if(qsize <= 0) {
+			sup_condvar.wait(lock);
+			continue;
+		}
+		sup_sleeping = false;
 
-		while(!quit && !workq.empty()) {
-			WorkItem witem = workq.front();
-			workq.pop_front();
-			++nactive;
-			--qsize;
-			lock.unlock();
+		// jobs piling up while every worker is busy means they're blocked,
+		// or just too few to keep up, so add another one
+		if(nidle == 0 && nlive < num_threads) {
+			unsigned long long tenq = oldest_queued();
+			if(tenq && usec_now() - tenq >= max_wait) {
+				start_worker();
+			}
+		}
+		sup_condvar.wait_for(lock, queue_wait);
+	}
+}
+
+void ThreadPool::enable_stats(bool enable)
+{
+	stats_enabled.store(enable, std::memory_order_relaxed);
+}
 
-			witem.work();
-			if(witem.done) {
-				witem.done();
+void ThreadPool::reset_stats()
+{
+	for(int i=0; i<=num_threads; i++) {
+		StatCounters *st = tstats + i;
+		st->jobs.store(0, std::memory_order_relaxed);
+		st->wakeups.store(0, std::memory_order_relaxed);
+		st->busy_us.store(0, std::memory_order_relaxed);
+		st->idle_us.store(0, std::memory_order_relaxed);
+		st->spawned.store(0, std::memory_order_relaxed);
+		st->retired.store(0, std::memory_order_relaxed);
+		for(int j=0; j<HIST_BINS; j++) {
+			st->wait_hist[j].store(0, std::memory_order_relaxed);
+			st->exec_hist[j].store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+// accumulate a snapshot of the counters into res
+void ThreadPool::merge_stats(Stats *res, const StatCounters *st)
+{
+	res->jobs += st->jobs.load(std::memory_order_relaxed);
+	res->wakeups += st->wakeups.load(std::memory_order_relaxed);
+	res->busy_us += st->busy_us.load(std::memory_order_relaxed);
+	res->idle_us += st->idle_us.load(std::memory_order_relaxed);
+	res->threads += st->threads.load(std::memory_order_relaxed);
+	res->spawned += st->spawned.load(std::memory_order_relaxed);
+	res->retired += st->retired.load(std::memory_order_relaxed);
+	for(int i=0; i<HIST_BINS; i++) {
+		res->wait_hist[i] += st->wait_hist[i].load(std::memory_order_relaxed);
+		res->exec_hist[i] += st->exec_hist[i].load(std::memory_order_relaxed);
+	}
+}
+
+ThreadPool::Stats ThreadPool::stats() const
+{
+	Stats res = {};
+	for(int i=0; i<=num_threads; i++) {
+		merge_stats(&res, tstats + i);
+	}
+	return res;
+}
+
+ThreadPool::Stats ThreadPool::stats(int thread_idx) const
+{
+	Stats res = {};
+	if(thread_idx >= 0 && thread_idx < num_threads) {
+		merge_stats(&res, tstats + thread_idx);
+	}
+	return res;
+}
+
+void ThreadPool::WorkDone::operator ()()
+{
+	work();
+	if(done) {
+		done();
+	}
+}
+
+void ThreadPool::WorkCancel::operator ()()
+{
+	if(!token.cancelled()) {
+		work();
+	}
+	if(done) {
+		done(token.cancelled());
+	}
+}
+
+ThreadPool::CancelToken::CancelToken()
+	: flag(std::make_shared<std::atomic<bool>>(false))
+{
+}
+
+void ThreadPool::CancelToken::cancel()
+{
+	flag->store(true, std::memory_order_release);
+}
+
+bool ThreadPool::CancelToken::cancelled() const
+{
+	return flag->load(std::memory_order_acquire);
+}
+
+// ---- Job implementation ----
+ThreadPool::Job::Job(Job &&job) noexcept
+{
+	if((ops = job.ops)) {
+		ops->move(buf, job.buf);
+		job.ops = 0;
+	}
+}
+
+ThreadPool::Job::~Job()
+{
+	reset();
+}
+
+ThreadPool::Job &ThreadPool::Job::operator =(Job &&job) noexcept
+{
+	if(&job != this) {
+		reset();
+		if((ops = job.ops)) {
+			ops->move(buf, job.buf);
+			job.ops = 0;
+		}
+	}
+	return *this;
+}
+
+void ThreadPool::Job::reset()
+{
+	if(ops) {
+		ops->destroy(buf);
+		ops = 0;
+	}
+}
+
+// ---- WorkQueue implementation ----
+ThreadPool::WorkQueue::WorkQueue()
+{
+	cells = 0;
+	mask = 0;
+	push_pos.store(0, std::memory_order_relaxed);
+	pop_pos.store(0, std::memory_order_relaxed);
+}
+
+void ThreadPool::WorkQueue::init(int size)
+{
+	unsigned long cap = 2;
+	while(cap < (unsigned long)size) {
+		cap <<= 1;
+	}
+	mask = cap - 1;
+
+	cells = new Cell[cap];
+	for(unsigned long i=0; i<cap; i++) {
+		cells[i].seq.store(i, std::memory_order_relaxed);
+		cells[i].tenq.store(0, std::memory_order_relaxed);
+	}
+	push_pos.store(0, std::memory_order_relaxed);
+	pop_pos.store(0, std::memory_order_relaxed);
+}
+
+ThreadPool::WorkQueue::~WorkQueue()
+{
+	delete [] cells;
+}
+
+bool ThreadPool::WorkQueue::push(WorkItem &&item)
+{
+	Cell *cell;
+	unsigned long pos = push_pos.load(std::memory_order_relaxed);
+
+	for(;;) {
+		cell = cells + (pos & mask);
+		unsigned long seq = cell->seq.load(std::memory_order_acquire);
+		long dif = (long)(seq - pos);
+
+		if(dif == 0) {
+			// cell is free in this lap, try to claim it
+			if(push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				break;
 			}
+		} else if(dif < 0) {
+			return false;	// full
+		} else {
+			pos = push_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	cell->tenq.store(item.tenq, std::memory_order_relaxed);
+	cell->item = std::move(item);
+	cell->seq.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+bool ThreadPool::WorkQueue::pop(WorkItem &item)
+{
+	Cell *cell;
+	unsigned long pos = pop_pos.load(std::memory_order_relaxed);
 
-			lock.lock();
-			--nactive;
-			done_condvar.notify_all();
+	for(;;) {
+		cell = cells + (pos & mask);
+		unsigned long seq = cell->seq.load(std::memory_order_acquire);
+		long dif = (long)(seq - (pos + 1));
+
+		if(dif == 0) {
+			// cell has been filled in this lap, try to claim it
+			if(pop_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				break;
+			}
+		} else if(dif < 0) {
+			return false;	// empty
+		} else {
+			pos = pop_pos.load(std::memory_order_relaxed);
 		}
 	}
+
+	item = std::move(cell->item);	// leaves the cell empty
+	cell->seq.store(pos + mask + 1, std::memory_order_release);
+	return true;
 }
 
+unsigned long long ThreadPool::WorkQueue::head_time() const
+{
+	unsigned long pos = pop_pos.load(std::memory_order_relaxed);
+	const Cell *cell = cells + (pos & mask);
+	if(cell->seq.load(std::memory_order_acquire) != pos + 1) {
+		return 0;
+	}
+	// might have been claimed and refilled since, which only makes it a
+	// newer job's time; good enough for a heuristic
+	return cell->tenq.load(std::memory_order_relaxed);
+}
@@ -1,47 +1,448 @@
 #ifndef THREAD_POOL_H_
 #define THREAD_POOL_H_
 
-#include <list>
+#include <vector>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <type_traits>
+#include <future>
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <exception>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define THREADPOOL_COROUTINES
+#endif
 
 class ThreadPool {
+public:
+	// job priority levels. Workers always pick the highest priority queued
+	// job, except that a lower priority level which has been passed over too
+	// many times in a row gets to run its next job, so it can't starve.
+	enum { PRIO_HIGH, PRIO_NORMAL, PRIO_LOW, NUM_PRIO };
+
+	// number of bins in the latency histograms of Stats. Bins are log2
+	// microseconds: bin 0 counts durations under 1us, bin i counts durations
+	// in [2^(i-1), 2^i) us, and the last bin counts everything longer.
+	enum { HIST_BINS = 24 };
+
+	struct Stats {
+		unsigned long jobs;			// jobs executed
+		unsigned long wakeups;		// times woken up after parking
+		unsigned long long busy_us;	// time spent running jobs
+		unsigned long long idle_us;	// time spent parked
+		// worker threads running, started and exited (always recorded, and
+		// only interesting for elastic pools). Per thread, threads is 0 or 1.
+		int threads;
+		unsigned long spawned, retired;
+		unsigned long wait_hist[HIST_BINS];	// add_work to start latency
+		unsigned long exec_hist[HIST_BINS];	// job execution time
+	};
+
+	// cancellation token which can be attached to jobs when they're added.
+	// Copies share the same state, so the token can be kept by whoever might
+	// want to cancel a set of jobs, and captured by the jobs themselves, for
+	// long-running ones to poll cancelled() and return early.
+	class CancelToken {
+	private:
+		std::shared_ptr<std::atomic<bool>> flag;
+
+	public:
+		CancelToken();
+
+		void cancel();
+		bool cancelled() const;
+	};
+
+	// parameters of an elastic pool, see the constructor taking it
+	struct ElasticParams {
+		int min_threads, max_threads;
+		std::chrono::milliseconds queue_wait, idle_time;
+
+		ElasticParams(int min_threads = 1, int max_threads = -1,
+				std::chrono::milliseconds queue_wait = std::chrono::milliseconds(5),
+				std::chrono::milliseconds idle_time = std::chrono::milliseconds(1000))
+			: min_threads(min_threads), max_threads(max_threads),
+			queue_wait(queue_wait), idle_time(idle_time) {}
+	};
+
 private:
-	int num_threads;
+	int num_threads;		// number of thread slots (maximum pool size)
 	std::thread *thread;	// array of threads
+	// live workers always occupy slots [0, nlive). A worker which retires
+	// leaves its slot EXITED, and it's joined when the slot is reused.
+	enum { SLOT_UNUSED, SLOT_RUNNING, SLOT_EXITED };
+	std::vector<int> slot_state;
+	std::atomic<int> nlive;
 
-	struct WorkItem {
+	// move-only type-erased callable with inline storage, so that queueing a
+	// job doesn't allocate. Callables which don't fit, or might throw while
+	// being moved, are kept on the heap instead. The inline storage is sized
+	// for the jobs built by add_work: two std::functions and a cancel token.
+	class Job {
+	public:
+		enum { INLINE_SIZE = 2 * sizeof(std::function<void ()>) + sizeof(std::shared_ptr<void>) };
+
+	private:
+		struct Ops {
+			void (*invoke)(void *obj);
+			void (*move)(void *dest, void *src);	// also destroys src
+			void (*destroy)(void *obj);
+		};
+		template <typename F> struct InlineOps;
+		template <typename F> struct HeapOps;
+
+		alignas(std::max_align_t) unsigned char buf[INLINE_SIZE];
+		const Ops *ops;
+
+		template <typename Func, typename F> void init(F &&fn, std::true_type);
+		template <typename Func, typename F> void init(F &&fn, std::false_type);
+
+	public:
+		Job() : ops(0) {}
+		template <typename F, typename = typename std::enable_if<
+			!std::is_same<typename std::decay<F>::type, Job>::value>::type>
+		Job(F &&fn);
+		Job(Job &&job) noexcept;
+		~Job();
+
+		Job &operator =(Job &&job) noexcept;
+		Job(const Job&) = delete;
+		Job &operator =(const Job&) = delete;
+
+		void reset();
+		explicit operator bool() const { return ops != 0; }
+		void operator ()() { ops->invoke(buf); }
+	};
+
+	// work and done callbacks of add_work, fused into a single job
+	struct WorkDone {
+		std::function<void ()> work, done;
+		void operator ()();
+	};
+
+	// the queued job of a task. Destroying it without running it (clear_work)
+	// drops the task.
+	struct TaskState;
+	struct TaskJob {
+		TaskState *ts;
+
+		explicit TaskJob(TaskState *ts) : ts(ts) {}
+		TaskJob(TaskJob &&job) noexcept : ts(job.ts) { job.ts = 0; }
+		~TaskJob();
+		void operator ()();
+	};
+
+	struct WorkCancel {
+		CancelToken token;
 		std::function<void ()> work;
-		std::function<void ()> done;
+		std::function<void (bool)> done;
+		void operator ()();
 	};
 
-	int qsize;
-	std::list<WorkItem> workq;
+	struct WorkItem {
+		Job job;
+		unsigned long long tenq;	// enqueue time in usec, 0 if stats are off
+	};
+
+	static Job make_job(std::function<void ()> &&work_func, std::function<void ()> &&done_func);
+
+	// bounded lock-free multi-producer/multi-consumer ring buffer of work items.
+	// Each cell carries a sequence number which tells producers and consumers
+	// whether it's free for them to claim in the current lap around the ring.
+	class WorkQueue {
+	private:
+		struct Cell {
+			std::atomic<unsigned long> seq;
+			// copy of item.tenq which can be read without claiming the cell
+			std::atomic<unsigned long long> tenq;
+			WorkItem item;
+		};
+		Cell *cells;
+		unsigned long mask;
+
+		alignas(64) std::atomic<unsigned long> push_pos;
+		alignas(64) std::atomic<unsigned long> pop_pos;
+
+	public:
+		WorkQueue();
+		~WorkQueue();
+
+		void init(int size);	// size is rounded up to a power of two
+
+		WorkQueue(const WorkQueue&) = delete;
+		WorkQueue &operator =(const WorkQueue&) = delete;
+
+		bool push(WorkItem &&item);		// false if the queue is full
+		bool pop(WorkItem &item);		// false if the queue is empty
+		// enqueue time of the item at the head, or 0 if the queue is empty
+		unsigned long long head_time() const;
+	};
+
+	WorkQueue workq[NUM_PRIO];		// one queue per priority level
+	std::atomic<int> qsize;
+	std::atomic<int> qsize_prio[NUM_PRIO];
+	std::atomic<int> starve[NUM_PRIO];
 	mutable std::mutex workq_mutex;
 	std::condition_variable workq_condvar;
 
-	int nactive;	// number of active workers (not sleeping)
+	std::atomic<int> nactive;	// number of active workers (not sleeping)
+	std::atomic<int> nidle;		// number of workers parked on workq_condvar
+	std::atomic<int> nwaiters;	// number of threads blocked in wait
 
 	// condvar used by wait
 	std::condition_variable done_condvar;
 
-	bool quit;
+	std::atomic<bool> quit;
+
+	// statistics counters of each worker, plus one shared by all the other
+	// threads which run jobs while waiting. Only merged when read.
+	struct StatCounters {
+		std::atomic<unsigned long> jobs, wakeups;
+		std::atomic<unsigned long long> busy_us, idle_us;
+		std::atomic<int> threads;
+		std::atomic<unsigned long> spawned, retired;
+		std::atomic<unsigned long> wait_hist[HIST_BINS], exec_hist[HIST_BINS];
+	};
+	StatCounters *tstats;
+	std::atomic<bool> stats_enabled;
+
+	static void merge_stats(Stats *res, const StatCounters *st);
+
+	// completion tracking for a single parallel_for/parallel_reduce call
+	struct ForkJoin {
+		int pending;
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::exception_ptr error;	// first exception thrown by a chunk
+
+		void done();
+		void fail(std::exception_ptr e);
+	};
+
+	// shared state of a task created by add_task
+	struct TaskState {
+		ThreadPool *pool;
+		std::function<void ()> work, done;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		bool finished;
+		std::atomic<bool> dropped;	// won't run: dropped, or a predecessor was
+		std::atomic<int> ndeps;		// unfinished predecessors
+		std::vector<TaskState*> successors;
+		// keeps the state alive while it's waiting or queued
+		std::shared_ptr<TaskState> self;
+
+		void run();
+		void finish();
+	};
+
+	void thread_func(int id);
+	void push_work(int prio, WorkItem &&witem);
+	bool pop_work(WorkItem &witem);
+	void run_work(WorkItem &witem);
+	bool run_one();
+	void submit_task(TaskState *ts);
+
+	// delayed and periodic jobs, queued by a timer thread which is started on
+	// first use and sleeps until the earliest deadline.
+	struct TimerState {
+		std::function<void ()> func;
+		std::chrono::steady_clock::duration period;	// zero for one-shot timers
+		std::atomic<bool> cancelled, running;
+	};
+	struct TimerEntry {
+		std::chrono::steady_clock::time_point deadline;
+		int id;
+		std::shared_ptr<TimerState> st;
+
+		// reversed, so that the heap keeps the earliest deadline on top
+		bool operator <(const TimerEntry &e) const { return deadline > e.deadline; }
+	};
+	std::vector<TimerEntry> timers;		// binary heap
+	int next_timer_id;
+	bool timer_quit;
+	std::thread timer_thread;
+	std::mutex timer_mutex;
+	std::condition_variable timer_condvar;
+
+	int add_timer(std::chrono::steady_clock::duration delay,
+			std::chrono::steady_clock::duration period, std::function<void ()> &&func);
+	void timer_func();
+
+	// elastic pools: a supervisor thread starts a new worker whenever the
+	// oldest queued job has been waiting longer than queue_wait, and workers
+	// which stay parked for idle_time exit, highest slot first.
+	bool elastic;
+	int min_threads;
+	std::chrono::milliseconds queue_wait, idle_time;
+	std::thread supervisor;
+	std::condition_variable sup_condvar;
+	std::atomic<bool> sup_sleeping;	// parked until something is queued
 
-	void thread_func();
+	void init(int min_threads, int max_threads, int queue_size);
+	bool start_worker();
+	void supervisor_func();
+	unsigned long long oldest_queued() const;
+
+	int auto_grain(int count) const;
+	void join(ForkJoin *fj);
+	template <typename Body>
+	void run_range(ForkJoin *fj, int begin, int end, int grain, Body *body);
 
 public:
+	// handle to a job added with add_task, which can be used to wait for that
+	// particular job, or to make other jobs depend on it.
+	class TaskHandle {
+	private:
+		std::shared_ptr<TaskState> st;
+
+		friend class ThreadPool;
+
+	public:
+		bool valid() const;
+		// true after both the work and done callbacks have returned, or after
+		// the task was dropped
+		bool finished() const;
+		// true if the task was dropped by clear_work, or depends on one which
+		// was, and so never ran
+		bool dropped() const;
+		// waits for the task to finish. While waiting, queued jobs are run on
+		// the calling thread, so it's safe to call from inside a job.
+		void wait() const;
+	};
+
+	// chain of processing stages run over a stream of items, like a TBB
+	// pipeline. The first stage is the input: it's called one at a time with
+	// a null argument, and returns the next item, or null when the input is
+	// exhausted. Every other stage takes the item returned by the previous
+	// one, and returns the item to pass on (usually the same, or a new one
+	// replacing it). The last stage should free the item if necessary.
+	// PARALLEL stages may run on any number of items at once. SERIAL stages
+	// run on one item at a time, in input order. A stage returning null drops
+	// the item, and it skips the rest of the stages.
+	// At most max_tokens items are in flight between the input and the end of
+	// the pipeline at any time, so reading can't run ahead of processing.
+	class Pipeline {
+	public:
+		enum { SERIAL, PARALLEL };
+
+		explicit Pipeline(ThreadPool *pool);
+
+		void add_stage(int mode, std::function<void *(void *)> func);
+		// runs the pipeline until the input is exhausted and every item has
+		// gone through all the stages. max_tokens <= 0 allows twice as many
+		// items as there are threads. The calling thread processes items
+		// too, and runs other queued jobs while waiting, so it's safe to call
+		// from inside a job. Don't run the same pipeline concurrently.
+		void run(int max_tokens = 0);
+
+	private:
+		struct Item {
+			void *data;
+			unsigned long seq;		// input order
+
+			// reversed, so that the heap keeps the lowest seq on top
+			bool operator <(const Item &it) const { return seq > it.seq; }
+		};
+		struct Stage {
+			int mode;
+			std::function<void *(void *)> func;
+			// serial stages: the next item in order, and the items which
+			// arrived before their turn (binary heap)
+			unsigned long next_seq;
+			std::vector<Item> waiting;
+		};
+
+		ThreadPool *pool;
+		std::vector<Stage> stages;
+
+		std::mutex input_mutex;
+		bool input_done;
+		unsigned long input_seq;
+
+		std::mutex mutex;		// protects serial stage state and ntokens
+		std::condition_variable cv;
+		int ntokens;			// tokens which haven't retired yet
+
+		void run_token(Item item, size_t first_stage);
+	};
+
 	// passing num_threads == -1 auto-detects based on number of processors
-	explicit ThreadPool(int num_threads = -1);
+	// queue_size is the capacity of the work queue of each priority level
+	// (rounded to a power of two).
+	// add_work on a full queue from a worker thread runs queued jobs until
+	// there's room; other threads wait for the workers to make room.
+	explicit ThreadPool(int num_threads = -1, int queue_size = 4096);
+	// elastic pool, which starts with min_threads workers and starts more, up
+	// to max_threads (-1 for the number of processors), whenever a queued job
+	// has been waiting longer than queue_wait, as happens when the workers are
+	// blocked on I/O. Workers which stay idle for idle_time exit, down to
+	// min_threads (at least 1). wait() works the same as with fixed pools.
+	explicit ThreadPool(const ElasticParams &params, int queue_size = 4096);
 	~ThreadPool();
 
 	void add_work(std::function<void ()> func);
 	void add_work(std::function<void ()> work_func, std::function<void ()> done_func);
+	// takes any rvalue callable without wrapping it in a std::function. Up to
+	// Job::INLINE_SIZE bytes of captured state are stored in the queue itself,
+	// so queueing and running the job doesn't allocate.
+	template <typename Func, typename = typename std::enable_if<
+		!std::is_lvalue_reference<Func>::value>::type>
+	void add_work(Func &&fn);
+	// add_work with a cancellation token. If the token is cancelled before
+	// the job starts, work_func is skipped. done_func is called either way,
+	// with true if the token was cancelled before the job started or while it
+	// was running, in which case work_func may have stopped early.
+	void add_work(const CancelToken &token, std::function<void ()> work_func,
+			std::function<void (bool)> done_func = std::function<void (bool)>{});
+	// add_work with a priority level (PRIO_*); add_work uses PRIO_NORMAL
+	void add_work_prio(int prio, std::function<void ()> work_func,
+			std::function<void ()> done_func = std::function<void ()>{});
 	void clear_work();
 
+	// queue a job after the specified delay, or every period (the first time
+	// after one period). Timing is accurate to about a millisecond. A periodic
+	// job which is still running when its next period comes up skips that
+	// run, so runs never overlap. Both return an id for cancel_timer.
+	int add_work_after(std::chrono::steady_clock::duration delay, std::function<void ()> func);
+	int add_work_every(std::chrono::steady_clock::duration period, std::function<void ()> func);
+	// stops a delayed or periodic job from being queued again, and skips it if
+	// it's queued but hasn't started. A run already in progress is not
+	// interrupted. Returns false if there's no such timer, or if it was a
+	// one-shot which has already been queued.
+	bool cancel_timer(int id);
+
+	// like add_work, but returns a handle to the job. The variant taking a list
+	// of dependencies keeps the job off the queue until all of them have
+	// finished. Handles cost an extra allocation per job, so plain add_work is
+	// preferable when there's nothing to wait on. Tasks dropped by clear_work
+	// finish without running, and so do the tasks depending on them, once all
+	// their other dependencies have finished (see TaskHandle::dropped).
+	TaskHandle add_task(std::function<void ()> work_func,
+			std::function<void ()> done_func = std::function<void ()>{});
+	TaskHandle add_task(const std::vector<TaskHandle> &deps, std::function<void ()> work_func,
+			std::function<void ()> done_func = std::function<void ()>{});
+
+	// runs fn on the pool and returns a future for its result, optionally
+	// after all tasks in deps have finished. Note that future::get blocks
+	// without running other jobs; from inside a job, prefer TaskHandle::wait.
+	template <typename Func>
+	auto submit(Func fn) -> std::future<decltype(fn())>;
+	template <typename Func>
+	auto submit(const std::vector<TaskHandle> &deps, Func fn) -> std::future<decltype(fn())>;
+
 	// returns the number of queued work items
 	int queued() const;
+	// returns the number of queued work items of a specific priority level
+	int queued(int prio) const;
 	// returns the number of active threads
 	int active() const;
 	// returns number of pending work items (both in the queue and active)
@@ -50,6 +451,241 @@ public:
 	// waits for all work to be completed
 	long wait();
 	long wait(long timeout);
+
+	// statistics are disabled by default. When enabled, each worker updates
+	// its own counters, which costs a couple of clock reads per job.
+	void enable_stats(bool enable = true);
+	void reset_stats();
+	// returns the combined statistics of all threads, including jobs run by
+	// other threads while waiting (join, TaskHandle::wait, full queue).
+	Stats stats() const;
+	// returns the statistics of a single worker thread slot. Indices go up to
+	// the maximum number of threads for elastic pools.
+	Stats stats(int thread_idx) const;
+
+	// calls fn(i) for every i in [begin, end), and returns when all calls are
+	// done. The range is split in halves down to chunks of "grain" indices, but
+	// only while the workers are starved for work; otherwise chunks are run on
+	// the calling thread. grain <= 0 picks a grain based on the number of
+	// threads. The calling thread works on the range too, and while waiting for
+	// the rest it runs queued jobs instead of blocking, so it's safe to nest
+	// parallel_for calls inside jobs. If fn throws, the rest of its chunk is
+	// skipped, and the first exception is rethrown once all chunks are done.
+	template <typename Func>
+	void parallel_for(int begin, int end, int grain, Func fn);
+
+	// folds acc = func(acc, i) over [begin, end), starting from identity in
+	// every chunk, and combines the chunk results with reduce(a, b).
+	// reduce must be associative and commutative, since the order in which
+	// chunks finish is unspecified. Splitting and exceptions work like
+	// parallel_for.
+	template <typename T, typename Func, typename Reduce>
+	T parallel_reduce(int begin, int end, int grain, T identity, Func func, Reduce reduce);
+
+#ifdef THREADPOOL_COROUTINES
+	// awaitable which resumes the awaiting coroutine on a pool worker:
+	//   co_await pool.schedule();
+	// See threadpool_coro.h for the coroutine task type.
+	class ScheduleAwaiter {
+	private:
+		ThreadPool *pool;
+
+	public:
+		explicit ScheduleAwaiter(ThreadPool *pool) : pool(pool) {}
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			pool->add_work([h]() { h.resume(); });
+		}
+		void await_resume() const noexcept {}
+	};
+
+	ScheduleAwaiter schedule() { return ScheduleAwaiter(this); }
+#endif
 };
 
+template <typename Func, typename>
+void ThreadPool::add_work(Func &&fn)
+{
+	push_work(PRIO_NORMAL, WorkItem{Job(std::forward<Func>(fn)), 0});
+}
+
+template <typename F>
+struct ThreadPool::Job::InlineOps {
+	static void invoke(void *obj) { (*(F*)obj)(); }
+	static void move(void *dest, void *src)
+	{
+		new(dest) F(std::move(*(F*)src));
+		((F*)src)->~F();
+	}
+	static void destroy(void *obj) { ((F*)obj)->~F(); }
+
+	static const Ops ops;
+};
+
+template <typename F>
+const ThreadPool::Job::Ops ThreadPool::Job::InlineOps<F>::ops = { invoke, move, destroy };
+
+template <typename F>
+struct ThreadPool::Job::HeapOps {
+	static void invoke(void *obj) { (**(F**)obj)(); }
+	static void move(void *dest, void *src) { *(F**)dest = *(F**)src; }
+	static void destroy(void *obj) { delete *(F**)obj; }
+
+	static const Ops ops;
+};
+
+template <typename F>
+const ThreadPool::Job::Ops ThreadPool::Job::HeapOps<F>::ops = { invoke, move, destroy };
+
+template <typename F, typename>
+ThreadPool::Job::Job(F &&fn)
+{
+	typedef typename std::decay<F>::type Func;
+	typedef std::integral_constant<bool, sizeof(Func) <= INLINE_SIZE &&
+		alignof(Func) <= alignof(std::max_align_t) &&
+		std::is_nothrow_move_constructible<Func>::value> fits_inline;
+
+	init<Func>(std::forward<F>(fn), fits_inline());
+}
+
+template <typename Func, typename F>
+void ThreadPool::Job::init(F &&fn, std::true_type)
+{
+	new(buf) Func(std::forward<F>(fn));
+	ops = &InlineOps<Func>::ops;
+}
+
+template <typename Func, typename F>
+void ThreadPool::Job::init(F &&fn, std::false_type)
+{
+	*(Func**)buf = new Func(std::forward<F>(fn));
+	ops = &HeapOps<Func>::ops;
+}
+
+template <typename Func>
+auto ThreadPool::submit(Func fn) -> std::future<decltype(fn())>
+{
+	return submit(std::vector<TaskHandle>{}, std::move(fn));
+}
+
+template <typename Func>
+auto ThreadPool::submit(const std::vector<TaskHandle> &deps, Func fn) -> std::future<decltype(fn())>
+{
+	typedef decltype(fn()) result_type;
+
+	auto task = std::make_shared<std::packaged_task<result_type ()>>(std::move(fn));
+	std::future<result_type> res = task->get_future();
+
+	if(deps.empty()) {
+		add_work([task]() { (*task)(); });
+	} else {
+		add_task(deps, [task]() { (*task)(); });
+	}
+	return res;
+}
+
+template <typename Body>
+void ThreadPool::run_range(ForkJoin *fj, int begin, int end, int grain, Body *body)
+{
+	while(end - begin > grain) {
+		if(qsize >= nlive) {
+			// workers have plenty to do, don't split further for now
+			(*body)(begin, begin + grain);
+			begin += grain;
+			continue;
+		}
+
+		int mid = begin + (end - begin) / 2;
+		{
+			std::unique_lock<std::mutex> lock(fj->mutex);
+			++fj->pending;
+		}
+		add_work([this, fj, mid, end, grain, body]() {
+			run_range(fj, mid, end, grain, body);
+		});
+		end = mid;
+	}
+	(*body)(begin, end);
+	fj->done();
+}
+
+template <typename Func>
+void ThreadPool::parallel_for(int begin, int end, int grain, Func fn)
+{
+	if(grain <= 0) {
+		grain = auto_grain(end - begin);
+	}
+	if(end - begin <= grain) {
+		for(int i=begin; i<end; i++) {
+			fn(i);
+		}
+		return;
+	}
+
+	// chunks are still running elsewhere when one throws, so exceptions are
+	// held until they're done with fj and body
+	ForkJoin fj;
+	fj.pending = 1;
+
+	auto body = [&fn, &fj](int b, int e) {
+		try {
+			for(int i=b; i<e; i++) {
+				fn(i);
+			}
+		}
+		catch(...) {
+			fj.fail(std::current_exception());
+		}
+	};
+
+	run_range(&fj, begin, end, grain, &body);
+	join(&fj);
+	if(fj.error) {
+		std::rethrow_exception(fj.error);
+	}
+}
+
+template <typename T, typename Func, typename Reduce>
+T ThreadPool::parallel_reduce(int begin, int end, int grain, T identity, Func func, Reduce reduce)
+{
+	if(grain <= 0) {
+		grain = auto_grain(end - begin);
+	}
+	if(end - begin <= grain) {
+		T acc = identity;
+		for(int i=begin; i<end; i++) {
+			acc = func(acc, i);
+		}
+		return acc;
+	}
+
+	T res = identity;
+	std::mutex res_mutex;
+	ForkJoin fj;
+	fj.pending = 1;
+
+	auto body = [&](int b, int e) {
+		try {
+			T acc = identity;
+			for(int i=b; i<e; i++) {
+				acc = func(acc, i);
+			}
+			std::unique_lock<std::mutex> lock(res_mutex);
+			res = reduce(res, acc);
+		}
+		catch(...) {
+			fj.fail(std::current_exception());
+		}
+	};
+
+	run_range(&fj, begin, end, grain, &body);
+	join(&fj);
+	if(fj.error) {
+		std::rethrow_exception(fj.error);
+	}
+	return res;
+}
+
 #endif	// THREAD_POOL_H_
@@ -0,0 +1,267 @@
+#ifndef THREADPOOL_CORO_H_
+#define THREADPOOL_CORO_H_
+
+// C++20 coroutine support for ThreadPool.
+//
+// CoTask<T> is a lazily started coroutine: it runs on the thread which awaits
+// it, until it moves to a pool worker by awaiting ThreadPool::schedule, and
+// resumes its awaiter on whichever thread it finishes:
+//
+//   CoTask<Mesh*> load_mesh_async(ThreadPool *pool, const char *fname)
+//   {
+//       co_await pool->schedule();
+//       co_return load_mesh(fname);
+//   }
+//
+// Nothing is allocated besides the coroutine frames themselves.
+
+#include "threadpool.h"
+
+#ifdef THREADPOOL_COROUTINES
+
+#include <atomic>
+#include <optional>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+
+template <typename T = void> class CoTask;
+
+struct CoPromiseBase {
+	std::coroutine_handle<> cont;		// coroutine awaiting this one
+	std::atomic<int> *join = nullptr;	// completion counter of when_all
+	std::exception_ptr exc;
+
+	// on completion, transfer control straight to the awaiting coroutine. Under
+	// when_all, only the last task to finish resumes it.
+	struct FinalAwaiter {
+		bool await_ready() const noexcept { return false; }
+
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			CoPromiseBase &p = h.promise();
+			if(p.join && p.join->fetch_sub(1, std::memory_order_acq_rel) != 1) {
+				return std::noop_coroutine();
+			}
+			return p.cont ? p.cont : std::noop_coroutine();
+		}
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	FinalAwaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept { exc = std::current_exception(); }
+};
+
+template <typename T>
+struct CoPromise : CoPromiseBase {
+	std::optional<T> value;
+
+	CoTask<T> get_return_object() noexcept;
+
+	template <typename U>
+	void return_value(U &&val) { value.emplace(std::forward<U>(val)); }
+
+	T result()
+	{
+		if(exc) std::rethrow_exception(exc);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct CoPromise<void> : CoPromiseBase {
+	CoTask<void> get_return_object() noexcept;
+
+	void return_void() noexcept {}
+
+	void result()
+	{
+		if(exc) std::rethrow_exception(exc);
+	}
+};
+
+template <typename T>
+class CoTask {
+public:
+	typedef CoPromise<T> promise_type;
+	typedef std::coroutine_handle<promise_type> handle_type;
+
+private:
+	handle_type coro;
+
+	template <typename U> friend struct CoWhenAll;
+
+public:
+	class Awaiter {
+	private:
+		handle_type coro;
+
+	public:
+		explicit Awaiter(handle_type h) : coro(h) {}
+
+		bool await_ready() const noexcept { return !coro || coro.done(); }
+		// start the task, and have it resume us when it's done
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+		{
+			coro.promise().cont = h;
+			return coro;
+		}
+		// a default-constructed or moved-from task has nothing to await
+		T await_resume()
+		{
+			if(!coro) {
+				throw std::logic_error("awaiting an empty CoTask");
+			}
+			return coro.promise().result();
+		}
+	};
+
+	CoTask() : coro(nullptr) {}
+	explicit CoTask(handle_type h) : coro(h) {}
+	CoTask(CoTask &&t) noexcept : coro(std::exchange(t.coro, nullptr)) {}
+	~CoTask() { if(coro) coro.destroy(); }
+
+	CoTask &operator =(CoTask &&t) noexcept
+	{
+		if(&t != this) {
+			if(coro) coro.destroy();
+			coro = std::exchange(t.coro, nullptr);
+		}
+		return *this;
+	}
+	CoTask(const CoTask&) = delete;
+	CoTask &operator =(const CoTask&) = delete;
+
+	bool valid() const { return (bool)coro; }
+	bool done() const { return !coro || coro.done(); }
+
+	Awaiter operator co_await() const noexcept { return Awaiter(coro); }
+};
+
+template <typename T>
+CoTask<T> CoPromise<T>::get_return_object() noexcept
+{
+	return CoTask<T>(std::coroutine_handle<CoPromise<T>>::from_promise(*this));
+}
+
+inline CoTask<void> CoPromise<void>::get_return_object() noexcept
+{
+	return CoTask<void>(std::coroutine_handle<CoPromise<void>>::from_promise(*this));
+}
+
+// starts all tasks, and resumes the awaiting coroutine once every one of
+// them has finished. The count starts one higher than the number of tasks,
+// so that none of them can resume the awaiter before all have been started.
+template <typename T>
+struct CoWhenAll {
+	std::vector<CoTask<T>> &tasks;
+	std::atomic<int> count;
+
+	explicit CoWhenAll(std::vector<CoTask<T>> &tasks) : tasks(tasks), count(0) {}
+
+	bool await_ready() const noexcept { return tasks.empty(); }
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		// check before starting any, so that none is left running unawaited
+		for(CoTask<T> &t : tasks) {
+			if(!t.coro) {
+				throw std::logic_error("when_all on an empty CoTask");
+			}
+		}
+		count.store((int)tasks.size() + 1, std::memory_order_relaxed);
+		for(CoTask<T> &t : tasks) {
+			CoPromise<T> &p = t.coro.promise();
+			p.cont = h;
+			p.join = &count;
+			t.coro.resume();
+		}
+		return count.fetch_sub(1, std::memory_order_acq_rel) != 1;
+	}
+	void await_resume() const noexcept {}
+
+	static T result(CoTask<T> &t) { return t.coro.promise().result(); }
+};
+
+// awaits all tasks concurrently, and returns their results in order. Tasks
+// start on the awaiting thread, so to actually run in parallel, each should
+// begin by awaiting ThreadPool::schedule. If any of them throws, the first
+// exception (in task order) is rethrown after all have finished.
+template <typename T>
+CoTask<std::vector<T>> when_all(std::vector<CoTask<T>> tasks)
+{
+	co_await CoWhenAll<T>(tasks);
+
+	std::vector<T> res;
+	res.reserve(tasks.size());
+	for(CoTask<T> &t : tasks) {
+		res.push_back(CoWhenAll<T>::result(t));
+	}
+	co_return res;
+}
+
+inline CoTask<void> when_all(std::vector<CoTask<void>> tasks)
+{
+	co_await CoWhenAll<void>(tasks);
+
+	for(CoTask<void> &t : tasks) {
+		CoWhenAll<void>::result(t);
+	}
+}
+
+// fire-and-forget coroutine used by sync_wait to drive a task
+struct CoDetached {
+	struct promise_type {
+		CoDetached get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() const noexcept { return {}; }
+		std::suspend_never final_suspend() const noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+// runs a task to completion, blocking the calling thread, and returns its
+// result. Meant for starting coroutines from regular code; don't call it from
+// a pool worker, which would sit blocked instead of running jobs.
+template <typename T>
+T sync_wait(CoTask<T> task)
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool done = false;
+	std::exception_ptr exc;
+	std::optional<typename std::conditional<std::is_void<T>::value, char, T>::type> res;
+
+	auto drive = [&]() -> CoDetached {
+		try {
+			if constexpr(std::is_void<T>::value) {
+				co_await task;
+			} else {
+				res.emplace(co_await task);
+			}
+		}
+		catch(...) {
+			exc = std::current_exception();
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		done = true;
+		cv.notify_all();
+	};
+	drive();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	cv.wait(lock, [&]() { return done; });
+
+	if(exc) std::rethrow_exception(exc);
+	if constexpr(!std::is_void<T>::value) {
+		return std::move(*res);
+	}
+}
+
+#endif	// THREADPOOL_COROUTINES
+#endif	// THREADPOOL_CORO_H_
@@ -2,9 +2,16 @@
  * author: John Tsiombikas <nuclear@member.fsf.org>
  * This code is public domain.
  */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* for the CPU affinity calls */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include "tpool.h"
 
@@ -19,8 +26,15 @@
 
 #if defined(unix) || defined(__unix__)
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 
+# ifdef __linux__
+#  include <sched.h>
+#  include <dirent.h>
+#  include <sys/eventfd.h>
+# endif
+
 # ifdef __bsd__
 #  include <sys/sysctl.h>
 # endif
@@ -30,30 +44,118 @@
 #include <windows.h>
 #endif
 
+/* the job counters are shared between the workers and the wait calls without
+ * always holding workq_mutex (work-stealing mode), so access them atomically.
+ */
+#define ALOAD(x)	__atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define AINC(x)		__atomic_add_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define ADEC(x)		__atomic_sub_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define ASUB(x, n)	__atomic_sub_fetch(&(x), (n), __ATOMIC_SEQ_CST)
+#define AADD(x, n)	__atomic_add_fetch(&(x), (n), __ATOMIC_SEQ_CST)
+
+/* a non-empty priority level which has been passed over this many times in a
+ * row gets to run the next job.
+ */
+#define STARVE_LIMIT	16
+
+/* max number of strand jobs to run in a row, before letting other jobs go
+ * ahead of the rest.
+ */
+#define STRAND_BATCH	16
+
+/* statistics counters are updated by their own thread, and read or reset by
+ * others at any time, so they're atomic, but don't need to be ordered.
+ */
+#define SADD(x, n)	__atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define SLOAD(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define SSTORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+/* elastic pool defaults */
+#define DEF_QUEUE_WAIT_MS	5
+#define DEF_IDLE_MS			1000
+
+/* worker thread slot states */
+enum { SLOT_UNUSED, SLOT_RUNNING, SLOT_EXITED };
+
 
 struct work_item {
 	void *data;
 	tpool_callback work, done;
-	struct work_item *next;
+	int prio;
+	struct tpool_group *grp;
+	struct work_block *block;	/* non-null if allocated by tpool_enqueue_many */
+	unsigned long long tenq;	/* enqueue time in usec, 0 if stats are off */
+	struct work_item *next, *prev;
+};
+
+/* work items allocated together by tpool_enqueue_many. The block is freed
+ * when the last of its items is done.
+ */
+struct work_block {
+	int nref;
+	struct work_item item[1];
+};
+
+/* per-worker double-ended queue used in work-stealing mode, one for each
+ * priority level. The owner pushes and pops at the head, thieves steal from
+ * the tail.
+ */
+struct work_deque {
+	struct work_item *head, *tail;
+	int size;		/* atomic, can be peeked without holding the lock */
+	pthread_mutex_t lock;
 };
 
 struct thread_data {
 	int id;
+	int state;		/* SLOT_*, changed with workq_mutex held */
 	struct thread_pool *pool;
+	struct work_deque dq[TPOOL_NUM_PRIO];
+	int starve[TPOOL_NUM_PRIO];
+	struct tpool_stats stats;
+
+	int cpu, node;	/* CPU pinned to and its NUMA node, or -1 */
+	int *victims;	/* other workers in stealing order, same node first */
+};
+
+/* workers pinned to the CPUs of a NUMA node */
+struct numa_node {
+	int *workers;
+	int count;
+	unsigned int next;	/* round-robin worker for non-worker enqueues */
 };
 
 struct thread_pool {
 	pthread_t *threads;
 	struct thread_data *tdata;
-	int num_threads;
+	int num_threads;	/* number of thread slots (max_threads if elastic) */
+	int nlive;			/* running workers, always in the first nlive slots */
 	pthread_key_t idkey;
+	unsigned int flags;
+	void *(*tfunc)(void*);
+
+	/* elastic mode: a supervisor thread starts workers, up to num_threads, when
+	 * jobs have been queued for longer than queue_wait_ms. Idle workers exit
+	 * after idle_ms, down to min_threads.
+	 */
+	int elastic;
+	int min_threads;
+	long queue_wait_ms, idle_ms;
+	pthread_t supervisor;
+	pthread_cond_t sup_condvar;
+	int sup_sleeping;	/* supervisor is waiting for jobs to be queued */
 
 	int qsize;
-	struct work_item *workq, *workq_tail;
+	int nqueued[TPOOL_NUM_PRIO];	/* queued jobs per priority level */
+	struct work_item *workq[TPOOL_NUM_PRIO], *workq_tail[TPOOL_NUM_PRIO];
+	int starve[TPOOL_NUM_PRIO];
 	pthread_mutex_t workq_mutex;
 	pthread_cond_t workq_condvar;
 
 	int nactive;	/* number of active workers (not sleeping) */
+	int nidle;		/* number of workers blocked on workq_condvar */
+	int nwaiters;	/* number of threads blocked on done_condvar */
+	unsigned int next_dq;	/* round-robin deque for non-worker enqueues */
 
 	pthread_cond_t done_condvar;
 
@@ -62,15 +164,72 @@ struct thread_pool {
 
 	int nref;	/* reference count */
 
+	int stats_enabled;
+	struct tpool_stats ext_stats;	/* jobs run by non-worker threads */
+
+	int *cpus, num_cpus;		/* CPU set, null if unrestricted */
+	int *cpu_node, cpu_node_size;	/* NUMA node of each CPU */
+	struct numa_node *nodes;	/* null unless pinned to multiple nodes */
+	int num_nodes, *node_workers;
+	int *victim_buf;
+
 #if defined(WIN32) || defined(__WIN32__)
 	HANDLE wait_event;
 #else
 	int wait_pipe[2];
+	/* coalesced completion notification: event_wfd is signalled only when
+	 * ncompleted goes from 0 to 1. Both are the same eventfd on Linux.
+	 */
+	int event_fd, event_wfd;
+	int ncompleted;
 #endif
 };
 
+struct tpool_group {
+	struct thread_pool *pool;
+	int prio;
+	int pending;	/* jobs not completed yet, only reaches 0 under mutex */
+	int nenq;		/* bumped after every enqueue, wakes up the waiters */
+	int nwaiters;	/* threads sleeping in tpool_group_wait */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct tpool_strand {
+	struct thread_pool *pool;
+	struct work_item *head, *tail;	/* jobs waiting for their turn */
+	int npending;	/* posted jobs not completed yet */
+	int scheduled;	/* a strand_run job is queued or running in the pool */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;	/* signalled when scheduled is cleared */
+};
+
 static void *thread_func(void *args);
+static void *thread_func_ws(void *args);
+static void *supervisor_func(void *args);
+static int start_worker(struct thread_pool *tpool);
+static int idle_wait(struct thread_pool *tpool, struct thread_data *tdata);
+static void retire_worker(struct thread_pool *tpool, struct thread_data *tdata);
+static void wake_supervisor(struct thread_pool *tpool);
+static void abs_timeout(struct timespec *ts, long msec);
+static struct work_item *pop_workq(struct thread_pool *tpool);
+static struct work_item *ws_get_job(struct thread_pool *tpool, struct thread_data *tdata);
+static void run_job(struct thread_pool *tpool, struct thread_data *tdata,
+		struct work_item *job);
+static int run_one(struct thread_pool *tpool);
+static void group_notify(struct tpool_group *grp);
+static void group_job_done(struct tpool_group *grp);
+static void strand_run(void *cls);
+static void strand_discard(struct tpool_strand *st);
 static void send_done_event(struct thread_pool *tpool);
+static int pending(struct thread_pool *tpool);
+static unsigned long long get_usec(void);
+static int init_affinity(struct thread_pool *tpool, const int *cpus, int num_cpus);
+static void init_numa(struct thread_pool *tpool);
+static void set_thread_affinity(struct thread_data *tdata);
+static struct numa_node *caller_node(struct thread_pool *tpool);
+static void destroy_affinity(struct thread_pool *tpool);
+static void hist_add(unsigned long *hist, unsigned long long usec);
 
 static struct work_item *alloc_work_item(void);
 static void free_work_item(struct work_item *w);
@@ -78,44 +237,136 @@ static void free_work_item(struct work_item *w);
 
 struct thread_pool *tpool_create(int num_threads)
 {
-	int i;
+	return tpool_create_flags(num_threads, 0);
+}
+
+struct thread_pool *tpool_create_flags(int num_threads, unsigned int flags)
+{
+	return tpool_create_cpus(num_threads, flags, 0, 0);
+}
+
+static struct thread_pool *create_pool(int min_threads, int num_threads,
+		unsigned int flags, const int *cpus, int num_cpus, long queue_wait_ms, long idle_ms);
+
+struct thread_pool *tpool_create_cpus(int num_threads, unsigned int flags,
+		const int *cpus, int num_cpus)
+{
+	return create_pool(0, num_threads, flags, cpus, num_cpus, 0, 0);
+}
+
+struct thread_pool *tpool_create_elastic(int min_threads, int max_threads,
+		unsigned int flags, long queue_wait_ms, long idle_ms)
+{
+	if(max_threads <= 0) {
+		max_threads = tpool_num_processors();
+	}
+	if(min_threads < 1) min_threads = 1;
+	if(min_threads > max_threads) min_threads = max_threads;
+
+	return create_pool(min_threads, max_threads, flags, 0, 0,
+			queue_wait_ms > 0 ? queue_wait_ms : DEF_QUEUE_WAIT_MS,
+			idle_ms > 0 ? idle_ms : DEF_IDLE_MS);
+}
+
+/* min_threads == 0 creates a fixed-size pool */
+static struct thread_pool *create_pool(int min_threads, int num_threads,
+		unsigned int flags, const int *cpus, int num_cpus, long queue_wait_ms, long idle_ms)
+{
+	int i, j;
 	struct thread_pool *tpool;
 
 	if(!(tpool = calloc(1, sizeof *tpool))) {
 		return 0;
 	}
+	tpool->flags = flags;
 	pthread_mutex_init(&tpool->workq_mutex, 0);
 	pthread_cond_init(&tpool->workq_condvar, 0);
 	pthread_cond_init(&tpool->done_condvar, 0);
+	pthread_cond_init(&tpool->sup_condvar, 0);
 	pthread_key_create(&tpool->idkey, 0);
 
-	pthread_setspecific(tpool->idkey, (void*)0xffffffff);
-
 #if !defined(WIN32) && !defined(__WIN32__)
 	tpool->wait_pipe[0] = tpool->wait_pipe[1] = -1;
+	tpool->event_fd = tpool->event_wfd = -1;
 #endif
 
+	if((cpus || (flags & TPOOL_PIN_THREADS)) && init_affinity(tpool, cpus, num_cpus) == -1) {
+		destroy_affinity(tpool);
+		free(tpool);
+		return 0;
+	}
+
 	if(num_threads <= 0) {
-		num_threads = tpool_num_processors();
+		num_threads = tpool->cpus ? tpool->num_cpus : tpool_num_processors();
 	}
 	tpool->num_threads = num_threads;
 
+	if(min_threads > 0) {
+		tpool->elastic = 1;
+		tpool->min_threads = min_threads;
+		tpool->queue_wait_ms = queue_wait_ms;
+		tpool->idle_ms = idle_ms;
+	} else {
+		tpool->min_threads = num_threads;
+	}
+
 	if(!(tpool->threads = calloc(num_threads, sizeof *tpool->threads))) {
+		destroy_affinity(tpool);
 		free(tpool);
 		return 0;
 	}
 	if(!(tpool->tdata = malloc(num_threads * sizeof *tpool->tdata))) {
 		free(tpool->threads);
+		destroy_affinity(tpool);
+		free(tpool);
+		return 0;
+	}
+	if(!(tpool->victim_buf = malloc(num_threads * num_threads * sizeof *tpool->victim_buf))) {
+		free(tpool->tdata);
+		free(tpool->threads);
+		destroy_affinity(tpool);
 		free(tpool);
 		return 0;
 	}
 
 	for(i=0; i<num_threads; i++) {
 		tpool->tdata[i].id = i;
+		tpool->tdata[i].state = SLOT_UNUSED;
 		tpool->tdata[i].pool = tpool;
+		tpool->tdata[i].cpu = tpool->tdata[i].node = -1;
+		if(tpool->cpus && (flags & TPOOL_PIN_THREADS)) {
+			int cpu = tpool->cpus[i % tpool->num_cpus];
+			tpool->tdata[i].cpu = cpu;
+			if(cpu < tpool->cpu_node_size) {
+				tpool->tdata[i].node = tpool->cpu_node[cpu];
+			}
+		}
+		for(j=0; j<TPOOL_NUM_PRIO; j++) {
+			struct work_deque *dq = tpool->tdata[i].dq + j;
+			dq->head = dq->tail = 0;
+			dq->size = 0;
+			pthread_mutex_init(&dq->lock, 0);
+			tpool->tdata[i].starve[j] = 0;
+		}
+		memset(&tpool->tdata[i].stats, 0, sizeof tpool->tdata[i].stats);
+	}
+	init_numa(tpool);
+
+	tpool->tfunc = (flags & TPOOL_WORK_STEALING) ? thread_func_ws : thread_func;
 
-		if(pthread_create(tpool->threads + i, 0, thread_func, tpool->tdata + i) == -1) {
-			/*tpool->threads[i] = 0;*/
+	pthread_mutex_lock(&tpool->workq_mutex);
+	for(i=0; i<tpool->min_threads; i++) {
+		if(start_worker(tpool) == -1) {
+			pthread_mutex_unlock(&tpool->workq_mutex);
+			tpool_destroy(tpool);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&tpool->workq_mutex);
+
+	if(tpool->elastic) {
+		if(pthread_create(&tpool->supervisor, 0, supervisor_func, tpool) != 0) {
+			tpool->elastic = 0;
 			tpool_destroy(tpool);
 			return 0;
 		}
@@ -125,22 +376,43 @@ struct thread_pool *tpool_create(int num_threads)
 
 void tpool_destroy(struct thread_pool *tpool)
 {
-	int i;
+	int i, j;
 	if(!tpool) return;
 
 	tpool_clear(tpool);
-	tpool->should_quit = 1;
 
+	pthread_mutex_lock(&tpool->workq_mutex);
+	__atomic_store_n(&tpool->should_quit, 1, __ATOMIC_SEQ_CST);
 	pthread_cond_broadcast(&tpool->workq_condvar);
+	pthread_cond_broadcast(&tpool->sup_condvar);
+	pthread_mutex_unlock(&tpool->workq_mutex);
+
+	/* stop the supervisor first, so that no more workers are started. Workers
+	 * don't retire after should_quit is set, so the slot states are final.
+	 */
+	if(tpool->elastic) {
+		pthread_join(tpool->supervisor, 0);
+	}
 
 	if(tpool->threads) {
 		for(i=0; i<tpool->num_threads; i++) {
-			pthread_join(tpool->threads[i], 0);
+			if(tpool->tdata[i].state != SLOT_UNUSED) {
+				pthread_join(tpool->threads[i], 0);
+			}
 		}
 		putchar('\n');
 		free(tpool->threads);
 	}
-	free(tpool->tdata);
+	if(tpool->tdata) {
+		for(i=0; i<tpool->num_threads; i++) {
+			for(j=0; j<TPOOL_NUM_PRIO; j++) {
+				pthread_mutex_destroy(&tpool->tdata[i].dq[j].lock);
+			}
+		}
+		free(tpool->tdata);
+	}
+	free(tpool->victim_buf);
+	destroy_affinity(tpool);
 
 	/* also wake up anyone waiting on the wait* calls */
 	tpool->nactive = 0;
@@ -150,6 +422,7 @@ void tpool_destroy(struct thread_pool *tpool)
 	pthread_mutex_destroy(&tpool->workq_mutex);
 	pthread_cond_destroy(&tpool->workq_condvar);
 	pthread_cond_destroy(&tpool->done_condvar);
+	pthread_cond_destroy(&tpool->sup_condvar);
 	pthread_key_delete(tpool->idkey);
 
 #if defined(WIN32) || defined(__WIN32__)
@@ -161,6 +434,12 @@ void tpool_destroy(struct thread_pool *tpool)
 		close(tpool->wait_pipe[0]);
 		close(tpool->wait_pipe[1]);
 	}
+	if(tpool->event_fd >= 0) {
+		close(tpool->event_fd);
+		if(tpool->event_wfd != tpool->event_fd) {
+			close(tpool->event_wfd);
+		}
+	}
 #endif
 }
 
@@ -186,93 +465,352 @@ void tpool_begin_batch(struct thread_pool *tpool)
 void tpool_end_batch(struct thread_pool *tpool)
 {
 	tpool->in_batch = 0;
+	pthread_mutex_lock(&tpool->workq_mutex);
 	pthread_cond_broadcast(&tpool->workq_condvar);
+	pthread_mutex_unlock(&tpool->workq_mutex);
 }
 
-int tpool_enqueue(struct thread_pool *tpool, void *data,
-		tpool_callback work_func, tpool_callback done_func)
+/* splice a pre-linked chain of n jobs into a deque: at the head if it's our
+ * own, at the tail otherwise.
+ */
+static void splice_deque(struct thread_pool *tpool, struct work_deque *dq,
+		struct work_item *first, struct work_item *last, int n, int own)
+{
+	pthread_mutex_lock(&dq->lock);
+	AADD(tpool->nqueued[first->prio], n);
+	AADD(tpool->qsize, n);
+	if(own) {
+		first->prev = 0;
+		last->next = dq->head;
+		if(dq->head) {
+			dq->head->prev = last;
+		} else {
+			dq->tail = last;
+		}
+		dq->head = first;
+	} else {
+		last->next = 0;
+		first->prev = dq->tail;
+		if(dq->tail) {
+			dq->tail->next = first;
+		} else {
+			dq->head = first;
+		}
+		dq->tail = last;
+	}
+	AADD(dq->size, n);
+	pthread_mutex_unlock(&dq->lock);
+}
+
+/* work-stealing mode enqueue: jobs submitted by a worker go to the head of
+ * its own deque, jobs from any other thread are distributed round-robin to
+ * the tails of the worker deques.
+ */
+static void enqueue_ws(struct thread_pool *tpool, struct work_item *job)
+{
+	struct thread_data *td = pthread_getspecific(tpool->idkey);
+
+	if(td && td->pool == tpool) {
+		splice_deque(tpool, td->dq + job->prio, job, job, 1, 1);
+	} else {
+		unsigned int idx;
+		struct numa_node *nd = caller_node(tpool);
+
+		if(nd) {
+			idx = __atomic_fetch_add(&nd->next, 1, __ATOMIC_RELAXED);
+			td = tpool->tdata + nd->workers[idx % nd->count];
+		} else {
+			idx = __atomic_fetch_add(&tpool->next_dq, 1, __ATOMIC_RELAXED);
+			td = tpool->tdata + idx % ALOAD(tpool->nlive);
+		}
+		splice_deque(tpool, td->dq + job->prio, job, job, 1, 0);
+	}
+
+	/* qsize is incremented before checking nidle, and idle workers increment
+	 * nidle before checking qsize, so at least one side sees the other.
+	 */
+	if(!tpool->in_batch && ALOAD(tpool->nidle) > 0) {
+		pthread_mutex_lock(&tpool->workq_mutex);
+		pthread_cond_signal(&tpool->workq_condvar);
+		pthread_mutex_unlock(&tpool->workq_mutex);
+	}
+}
+
+/* append a pre-linked chain of n jobs to the queue of their priority level.
+ * call with workq_mutex held.
+ */
+static void append_workq(struct thread_pool *tpool, struct work_item *first,
+		struct work_item *last, int n)
+{
+	int prio = first->prio;
+
+	last->next = 0;
+	if(tpool->workq[prio]) {
+		tpool->workq_tail[prio]->next = first;
+	} else {
+		tpool->workq[prio] = first;
+	}
+	tpool->workq_tail[prio] = last;
+	AADD(tpool->nqueued[prio], n);
+	AADD(tpool->qsize, n);
+}
+
+static int enqueue(struct thread_pool *tpool, struct tpool_group *grp, int prio,
+		void *data, tpool_callback work_func, tpool_callback done_func)
 {
 	struct work_item *job;
 
 	if(!(job = alloc_work_item())) {
 		return -1;
 	}
+	job->prio = prio < 0 ? 0 : (prio >= TPOOL_NUM_PRIO ? TPOOL_NUM_PRIO - 1 : prio);
 	job->work = work_func;
 	job->done = done_func;
 	job->data = data;
+	job->grp = grp;
+	job->block = 0;
+	job->tenq = SLOAD(tpool->stats_enabled) || tpool->elastic ? get_usec() : 0;
 	job->next = 0;
 
-	pthread_mutex_lock(&tpool->workq_mutex);
-	if(tpool->workq) {
-		tpool->workq_tail->next = job;
-		tpool->workq_tail = job;
+	if(grp) AINC(grp->pending);
+
+	if(tpool->flags & TPOOL_WORK_STEALING) {
+		enqueue_ws(tpool, job);
 	} else {
-		tpool->workq = tpool->workq_tail = job;
+		pthread_mutex_lock(&tpool->workq_mutex);
+		append_workq(tpool, job, job, 1);
+		pthread_mutex_unlock(&tpool->workq_mutex);
+
+		if(!tpool->in_batch) {
+			pthread_cond_broadcast(&tpool->workq_condvar);
+		}
 	}
-	++tpool->qsize;
-	pthread_mutex_unlock(&tpool->workq_mutex);
 
-	if(!tpool->in_batch) {
-		pthread_cond_broadcast(&tpool->workq_condvar);
+	if(grp) group_notify(grp);
+
+	wake_supervisor(tpool);
+	return 0;
+}
+
+int tpool_enqueue(struct thread_pool *tpool, void *data,
+		tpool_callback work_func, tpool_callback done_func)
+{
+	return enqueue(tpool, 0, TPOOL_PRIO_NORMAL, data, work_func, done_func);
+}
+
+int tpool_enqueue_prio(struct thread_pool *tpool, int prio, void *data,
+		tpool_callback work_func, tpool_callback done_func)
+{
+	return enqueue(tpool, 0, prio, data, work_func, done_func);
+}
+
+static void enqueue_many_ws(struct thread_pool *tpool, struct work_item *job, int n)
+{
+	int i, count, rem, nworkers, prio = job->prio;
+	int *workers = 0;
+	unsigned int idx;
+	struct numa_node *nd;
+	struct thread_data *td = pthread_getspecific(tpool->idkey);
+
+	if(td && td->pool == tpool) {
+		/* the others will steal from us if they're idle */
+		splice_deque(tpool, td->dq + prio, job, job + n - 1, n, 1);
+		return;
+	}
+
+	/* spread the jobs evenly across the worker deques, or just the deques of
+	 * the workers on our NUMA node, if the pool is NUMA-aware.
+	 */
+	if((nd = caller_node(tpool))) {
+		idx = __atomic_fetch_add(&nd->next, 1, __ATOMIC_RELAXED);
+		workers = nd->workers;
+		nworkers = nd->count;
+	} else {
+		idx = __atomic_fetch_add(&tpool->next_dq, 1, __ATOMIC_RELAXED);
+		nworkers = ALOAD(tpool->nlive);
+	}
+	count = n / nworkers;
+	rem = n % nworkers;
+
+	for(i=0; i<nworkers && n > 0; i++) {
+		int sz = count + (i < rem ? 1 : 0);
+		if(!sz) break;
+		idx %= nworkers;
+		td = tpool->tdata + (workers ? workers[idx] : (int)idx);
+		idx++;
+		splice_deque(tpool, td->dq + prio, job, job + sz - 1, sz, 0);
+		job += sz;
+		n -= sz;
+	}
+}
+
+static int enqueue_many(struct thread_pool *tpool, struct tpool_group *grp, int prio,
+		int n, void **data, tpool_callback work_func, tpool_callback done_func)
+{
+	int i, nwake;
+	unsigned long long tenq;
+	struct work_block *blk;
+	struct work_item *job;
+
+	if(n <= 0) return 0;
+
+	if(!(blk = malloc(offsetof(struct work_block, item) + n * sizeof *blk->item))) {
+		return -1;
+	}
+	blk->nref = n;
+	tenq = SLOAD(tpool->stats_enabled) || tpool->elastic ? get_usec() : 0;
+
+	job = blk->item;
+	for(i=0; i<n; i++) {
+		job[i].prio = prio;
+		job[i].data = data ? data[i] : 0;
+		job[i].work = work_func;
+		job[i].done = done_func;
+		job[i].grp = grp;
+		job[i].block = blk;
+		job[i].tenq = tenq;
+		job[i].prev = i > 0 ? job + i - 1 : 0;
+		job[i].next = i < n - 1 ? job + i + 1 : 0;
+	}
+
+	if(grp) AADD(grp->pending, n);
+
+	if(tpool->flags & TPOOL_WORK_STEALING) {
+		enqueue_many_ws(tpool, job, n);
+	} else {
+		pthread_mutex_lock(&tpool->workq_mutex);
+		append_workq(tpool, job, job + n - 1, n);
+		pthread_mutex_unlock(&tpool->workq_mutex);
+	}
+
+	/* wake up only as many workers as we have jobs for */
+	if(!tpool->in_batch && (nwake = ALOAD(tpool->nidle)) > 0) {
+		pthread_mutex_lock(&tpool->workq_mutex);
+		if(n >= nwake) {
+			pthread_cond_broadcast(&tpool->workq_condvar);
+		} else {
+			for(i=0; i<n; i++) {
+				pthread_cond_signal(&tpool->workq_condvar);
+			}
+		}
+		pthread_mutex_unlock(&tpool->workq_mutex);
 	}
+
+	if(grp) group_notify(grp);
+
+	wake_supervisor(tpool);
 	return 0;
 }
 
+int tpool_enqueue_many(struct thread_pool *tpool, int n, void **data,
+		tpool_callback work_func, tpool_callback done_func)
+{
+	return enqueue_many(tpool, 0, TPOOL_PRIO_NORMAL, n, data, work_func, done_func);
+}
+
+/* dropped jobs still have to be accounted for in their groups, or the group
+ * waiters would never return.
+ */
+static void discard_job(struct work_item *job)
+{
+	struct tpool_group *grp = job->grp;
+
+	/* dropping a strand's runner job drops everything posted to the strand */
+	if(job->work == strand_run) {
+		strand_discard(job->data);
+	}
+
+	free_work_item(job);
+	if(grp) {
+		group_job_done(grp);
+	}
+}
+
 void tpool_clear(struct thread_pool *tpool)
 {
+	int i, j, count;
+
 	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->workq) {
-		void *tmp = tpool->workq;
-		tpool->workq = tpool->workq->next;
-		free(tmp);
+	for(i=0; i<TPOOL_NUM_PRIO; i++) {
+		while(tpool->workq[i]) {
+			struct work_item *tmp = tpool->workq[i];
+			tpool->workq[i] = tpool->workq[i]->next;
+			discard_job(tmp);
+			ADEC(tpool->nqueued[i]);
+			ADEC(tpool->qsize);
+		}
+		tpool->workq_tail[i] = 0;
 	}
-	tpool->workq = tpool->workq_tail = 0;
-	tpool->qsize = 0;
 	pthread_mutex_unlock(&tpool->workq_mutex);
+
+	if(tpool->flags & TPOOL_WORK_STEALING) {
+		for(i=0; i<tpool->num_threads; i++) {
+			for(j=0; j<TPOOL_NUM_PRIO; j++) {
+				struct work_deque *dq = tpool->tdata[i].dq + j;
+
+				count = 0;
+				pthread_mutex_lock(&dq->lock);
+				while(dq->head) {
+					struct work_item *tmp = dq->head;
+					dq->head = dq->head->next;
+					discard_job(tmp);
+					count++;
+				}
+				dq->tail = 0;
+				__atomic_store_n(&dq->size, 0, __ATOMIC_SEQ_CST);
+				ASUB(tpool->nqueued[j], count);
+				ASUB(tpool->qsize, count);
+				pthread_mutex_unlock(&dq->lock);
+			}
+		}
+	}
 }
 
 int tpool_queued_jobs(struct thread_pool *tpool)
 {
-	int res;
-	pthread_mutex_lock(&tpool->workq_mutex);
-	res = tpool->qsize;
-	pthread_mutex_unlock(&tpool->workq_mutex);
-	return res;
+	return ALOAD(tpool->qsize);
+}
+
+int tpool_queued_jobs_prio(struct thread_pool *tpool, int prio)
+{
+	if(prio < 0 || prio >= TPOOL_NUM_PRIO) {
+		return 0;
+	}
+	return ALOAD(tpool->nqueued[prio]);
 }
 
 int tpool_active_jobs(struct thread_pool *tpool)
 {
-	int res;
-	pthread_mutex_lock(&tpool->workq_mutex);
-	res = tpool->nactive;
-	pthread_mutex_unlock(&tpool->workq_mutex);
-	return res;
+	return ALOAD(tpool->nactive);
 }
 
 int tpool_pending_jobs(struct thread_pool *tpool)
 {
-	int res;
-	pthread_mutex_lock(&tpool->workq_mutex);
-	res = tpool->qsize + tpool->nactive;
-	pthread_mutex_unlock(&tpool->workq_mutex);
-	return res;
+	return pending(tpool);
+}
+
+/* a job is counted as active before it's removed from the queue, so reading
+ * qsize first guarantees we never miss a job in transit.
+ */
+static int pending(struct thread_pool *tpool)
+{
+	int res = ALOAD(tpool->qsize);
+	return res + ALOAD(tpool->nactive);
 }
 
 void tpool_wait(struct thread_pool *tpool)
 {
-	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->nactive || tpool->qsize) {
-		pthread_cond_wait(&tpool->done_condvar, &tpool->workq_mutex);
-	}
-	pthread_mutex_unlock(&tpool->workq_mutex);
+	tpool_wait_pending(tpool, 0);
 }
 
 void tpool_wait_pending(struct thread_pool *tpool, int pending_target)
 {
 	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->qsize + tpool->nactive > pending_target) {
+	AINC(tpool->nwaiters);
+	while(pending(tpool) > pending_target) {
 		pthread_cond_wait(&tpool->done_condvar, &tpool->workq_mutex);
 	}
+	ADEC(tpool->nwaiters);
 	pthread_mutex_unlock(&tpool->workq_mutex);
 }
 
@@ -305,6 +843,21 @@ void *tpool_get_wait_handle(struct thread_pool *tpool)
 	return tpool->wait_event;
 }
 
+int tpool_get_event_fd(struct thread_pool *tpool)
+{
+	static int once;
+	if(!once) {
+		once = 1;
+		fprintf(stderr, "warning: tpool_get_event_fd call on Windows does nothing\n");
+	}
+	return -1;
+}
+
+int tpool_completed_jobs(struct thread_pool *tpool)
+{
+	return 0;
+}
+
 static void send_done_event(struct thread_pool *tpool)
 {
 	if(tpool->wait_event) {
@@ -327,12 +880,14 @@ long tpool_timedwait(struct thread_pool *tpool, long timeout)
 	tout_ts.tv_sec = tv0.tv_sec + sec;
 
 	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->nactive || tpool->qsize) {
+	AINC(tpool->nwaiters);
+	while(pending(tpool)) {
 		if(pthread_cond_timedwait(&tpool->done_condvar,
 					&tpool->workq_mutex, &tout_ts) == ETIMEDOUT) {
 			break;
 		}
 	}
+	ADEC(tpool->nwaiters);
 	pthread_mutex_unlock(&tpool->workq_mutex);
 
 	gettimeofday(&tv, 0);
@@ -359,11 +914,68 @@ void *tpool_get_wait_handle(struct thread_pool *tpool)
 	return 0;
 }
 
+int tpool_get_event_fd(struct thread_pool *tpool)
+{
+	int fd[2];
+
+	if(tpool->event_fd >= 0) {
+		return tpool->event_fd;
+	}
+
+#ifdef __linux__
+	if((fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		return -1;
+	}
+	fd[1] = fd[0];
+#else
+	if(pipe(fd) == -1) {
+		return -1;
+	}
+	fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK);
+#endif
+
+	tpool->event_fd = fd[0];
+	/* workers start signalling as soon as they see the write end */
+	__atomic_store_n(&tpool->event_wfd, fd[1], __ATOMIC_SEQ_CST);
+	return fd[0];
+}
+
+int tpool_completed_jobs(struct thread_pool *tpool)
+{
+	char buf[64];
+
+	if(tpool->event_fd < 0) {
+		return 0;
+	}
+
+	/* clear the fd before taking the count. A completion slipping in between
+	 * will signal it again, and at worst cause a spurious wakeup with nothing
+	 * to report, but never a lost one.
+	 */
+	while(read(tpool->event_fd, buf, sizeof buf) > 0);
+
+	return __atomic_exchange_n(&tpool->ncompleted, 0, __ATOMIC_SEQ_CST);
+}
+
 static void send_done_event(struct thread_pool *tpool)
 {
+	int efd;
+
 	if(tpool->wait_pipe[1] >= 0) {
 		write(tpool->wait_pipe[1], tpool, 1);
 	}
+
+	/* only the first completion since the last tpool_completed_jobs call
+	 * needs to make the fd readable.
+	 */
+	if((efd = ALOAD(tpool->event_wfd)) >= 0 && AINC(tpool->ncompleted) == 1) {
+#ifdef __linux__
+		eventfd_write(efd, 1);
+#else
+		write(efd, tpool, 1);
+#endif
+	}
 }
 #endif	/* WIN32/UNIX */
 
@@ -372,37 +984,37 @@ static void *thread_func(void *args)
 	struct thread_data *tdata = args;
 	struct thread_pool *tpool = tdata->pool;
 
-	pthread_setspecific(tpool->idkey, (void*)(intptr_t)tdata->id);
+	pthread_setspecific(tpool->idkey, tdata);
+	set_thread_affinity(tdata);
 
 	pthread_mutex_lock(&tpool->workq_mutex);
 	while(!tpool->should_quit) {
-		if(!tpool->workq) {
-			pthread_cond_wait(&tpool->workq_condvar, &tpool->workq_mutex);
+		if(!ALOAD(tpool->qsize)) {
+			int retire;
+			unsigned long long t0 = SLOAD(tpool->stats_enabled) ? get_usec() : 0;
+
+			AINC(tpool->nidle);
+			retire = idle_wait(tpool, tdata);
+			ADEC(tpool->nidle);
+
+			if(t0) {
+				SADD(tdata->stats.idle_us, get_usec() - t0);
+				SADD(tdata->stats.wakeups, 1);
+			}
+			if(retire) {
+				retire_worker(tpool, tdata);
+				break;
+			}
 			if(tpool->should_quit) break;
 		}
 
-		while(!tpool->should_quit && tpool->workq) {
-			/* grab the first job */
-			struct work_item *job = tpool->workq;
-			tpool->workq = tpool->workq->next;
-			if(!tpool->workq)
-				tpool->workq_tail = 0;
-			++tpool->nactive;
-			--tpool->qsize;
+		while(!tpool->should_quit && ALOAD(tpool->qsize)) {
+			struct work_item *job = pop_workq(tpool);
 			pthread_mutex_unlock(&tpool->workq_mutex);
 
-			/* do the job */
-			job->work(job->data);
-			if(job->done) {
-				job->done(job->data);
-			}
-			free_work_item(job);
+			run_job(tpool, tdata, job);
 
 			pthread_mutex_lock(&tpool->workq_mutex);
-			/* notify everyone interested that we're done with this job */
-			pthread_cond_broadcast(&tpool->done_condvar);
-			send_done_event(tpool);
-			--tpool->nactive;
 		}
 	}
 	pthread_mutex_unlock(&tpool->workq_mutex);
@@ -410,25 +1022,821 @@ static void *thread_func(void *args)
 	return 0;
 }
 
-
-int tpool_thread_id(struct thread_pool *tpool)
+/* pick the priority level to serve next: normally the highest priority
+ * non-empty level, unless a lower priority level has been passed over
+ * STARVE_LIMIT times in a row. starve can be null to ignore starvation.
+ * Returns -1 if all levels are empty.
+ */
+static int pick_prio(struct thread_pool *tpool, int *starve)
 {
-	int id = (intptr_t)pthread_getspecific(tpool->idkey);
-	if(id >= tpool->num_threads) {
-		return -1;
+	int i;
+
+	if(starve) {
+		for(i=TPOOL_NUM_PRIO-1; i>0; i--) {
+			if(starve[i] >= STARVE_LIMIT && ALOAD(tpool->nqueued[i])) {
+				return i;
+			}
+		}
+	}
+	for(i=0; i<TPOOL_NUM_PRIO; i++) {
+		if(ALOAD(tpool->nqueued[i])) {
+			return i;
+		}
 	}
-	return id;
+	return -1;
 }
 
-
-/* The following highly platform-specific code detects the number
- * of processors available in the system. It's used by the thread pool
- * to autodetect how many threads to spawn.
- * Currently works on: Linux, BSD, Darwin, and Windows.
+/* a job of priority prio was picked, count it against the waiting lower
+ * priority levels.
  */
-int tpool_num_processors(void)
+static void update_starve(struct thread_pool *tpool, int *starve, int prio)
 {
-#if defined(unix) || defined(__unix__)
+	int i;
+
+	starve[prio] = 0;
+	for(i=prio+1; i<TPOOL_NUM_PRIO; i++) {
+		if(ALOAD(tpool->nqueued[i])) {
+			starve[i]++;
+		}
+	}
+}
+
+/* grab the next job from the queues of the regular scheduler, and count it as
+ * active. Call with workq_mutex held.
+ */
+static struct work_item *pop_workq(struct thread_pool *tpool)
+{
+	int prio;
+	struct work_item *job;
+
+	if((prio = pick_prio(tpool, tpool->starve)) == -1) {
+		return 0;
+	}
+	update_starve(tpool, tpool->starve, prio);
+
+	job = tpool->workq[prio];
+	if(!(tpool->workq[prio] = job->next)) {
+		tpool->workq_tail[prio] = 0;
+	}
+	AINC(tpool->nactive);
+	ADEC(tpool->nqueued[prio]);
+	ADEC(tpool->qsize);
+	return job;
+}
+
+/* runs a job which has already been counted as active, and notifies
+ * everyone interested that it's done. tdata is null for non-worker threads.
+ */
+static void run_job(struct thread_pool *tpool, struct thread_data *tdata,
+		struct work_item *job)
+{
+	struct tpool_group *grp = job->grp;
+	struct tpool_stats *st = 0;
+	unsigned long long t0, t1;
+
+	if(SLOAD(tpool->stats_enabled)) {
+		st = tdata ? &tdata->stats : &tpool->ext_stats;
+		t0 = get_usec();
+		if(job->tenq) {
+			hist_add(st->wait_hist, t0 > job->tenq ? t0 - job->tenq : 0);
+		}
+	}
+
+	job->work(job->data);
+	if(job->done) {
+		job->done(job->data);
+	}
+	free_work_item(job);
+
+	if(st) {
+		t1 = get_usec();
+		SADD(st->jobs, 1);
+		SADD(st->busy_us, t1 - t0);
+		hist_add(st->exec_hist, t1 - t0);
+	}
+
+	if(grp) group_job_done(grp);
+
+	ADEC(tpool->nactive);
+	/* only take the lock to notify if someone is actually waiting */
+	if(ALOAD(tpool->nwaiters)) {
+		pthread_mutex_lock(&tpool->workq_mutex);
+		pthread_cond_broadcast(&tpool->done_condvar);
+		pthread_mutex_unlock(&tpool->workq_mutex);
+	}
+	send_done_event(tpool);
+}
+
+/* grab a single queued job and run it on the calling thread.
+ * returns 0 if there was nothing to run.
+ */
+static int run_one(struct thread_pool *tpool)
+{
+	struct work_item *job;
+	struct thread_data *tdata = pthread_getspecific(tpool->idkey);
+
+	if(tdata && tdata->pool != tpool) tdata = 0;
+
+	if(tpool->flags & TPOOL_WORK_STEALING) {
+		if(!(job = ws_get_job(tpool, tdata))) {
+			return 0;
+		}
+	} else {
+		pthread_mutex_lock(&tpool->workq_mutex);
+		job = pop_workq(tpool);
+		pthread_mutex_unlock(&tpool->workq_mutex);
+		if(!job) return 0;
+	}
+
+	run_job(tpool, tdata, job);
+	return 1;
+}
+
+/* pop a job of the specified priority from the head of our own deque, or
+ * failing that, steal one from the tail of another worker's deque. The job is
+ * counted as active while still holding the deque lock, before it's removed
+ * from qsize. tdata is null when called from a non-worker thread, which can
+ * only steal.
+ */
+static struct work_item *ws_get_job_prio(struct thread_pool *tpool,
+		struct thread_data *tdata, int prio)
+{
+	int i, nvictims;
+	struct work_deque *dq;
+	struct work_item *job;
+
+	if(!ALOAD(tpool->nqueued[prio])) {
+		return 0;
+	}
+
+	if(tdata) {
+		dq = tdata->dq + prio;
+		pthread_mutex_lock(&dq->lock);
+		if((job = dq->head)) {
+			if(!(dq->head = job->next)) {
+				dq->tail = 0;
+			} else {
+				dq->head->prev = 0;
+			}
+			ADEC(dq->size);
+			AINC(tpool->nactive);
+			ADEC(tpool->nqueued[prio]);
+			ADEC(tpool->qsize);
+			pthread_mutex_unlock(&dq->lock);
+			return job;
+		}
+		pthread_mutex_unlock(&dq->lock);
+	}
+
+	nvictims = tdata ? tpool->num_threads - 1 : tpool->num_threads;
+	for(i=0; i<nvictims; i++) {
+		struct thread_data *victim = tpool->tdata + (tdata ? tdata->victims[i] : i);
+
+		dq = victim->dq + prio;
+		/* unlocked peek to skip empty deques, rechecked under the lock */
+		if(!__atomic_load_n(&dq->size, __ATOMIC_RELAXED)) continue;
+
+		pthread_mutex_lock(&dq->lock);
+		if((job = dq->tail)) {
+			if(!(dq->tail = job->prev)) {
+				dq->head = 0;
+			} else {
+				dq->tail->next = 0;
+			}
+			ADEC(dq->size);
+			AINC(tpool->nactive);
+			ADEC(tpool->nqueued[prio]);
+			ADEC(tpool->qsize);
+			pthread_mutex_unlock(&dq->lock);
+
+			if(SLOAD(tpool->stats_enabled)) {
+				SADD((tdata ? &tdata->stats : &tpool->ext_stats)->steals, 1);
+			}
+			return job;
+		}
+		pthread_mutex_unlock(&dq->lock);
+	}
+	return 0;
+}
+
+/* work-stealing counterpart of pop_workq. Starvation is tracked per worker,
+ * non-worker threads just go by priority.
+ */
+static struct work_item *ws_get_job(struct thread_pool *tpool, struct thread_data *tdata)
+{
+	int i, prio;
+	int *starve = tdata ? tdata->starve : 0;
+	struct work_item *job;
+
+	if((prio = pick_prio(tpool, starve)) == -1) {
+		return 0;
+	}
+
+	/* the chosen level may have been emptied by others in the meantime */
+	if(!(job = ws_get_job_prio(tpool, tdata, prio))) {
+		for(i=0; i<TPOOL_NUM_PRIO; i++) {
+			if(i != prio && (job = ws_get_job_prio(tpool, tdata, i))) {
+				break;
+			}
+		}
+		if(!job) return 0;
+	}
+
+	if(starve) {
+		update_starve(tpool, starve, job->prio);
+	}
+	return job;
+}
+
+static void *thread_func_ws(void *args)
+{
+	int retire = 0;
+	struct thread_data *tdata = args;
+	struct thread_pool *tpool = tdata->pool;
+	struct work_item *job;
+
+	pthread_setspecific(tpool->idkey, tdata);
+	set_thread_affinity(tdata);
+
+	while(!ALOAD(tpool->should_quit)) {
+		unsigned long long t0;
+
+		if((job = ws_get_job(tpool, tdata))) {
+			run_job(tpool, tdata, job);
+			continue;
+		}
+
+		/* nothing to run or steal, sleep until something is enqueued */
+		t0 = SLOAD(tpool->stats_enabled) ? get_usec() : 0;
+
+		pthread_mutex_lock(&tpool->workq_mutex);
+		AINC(tpool->nidle);
+		while(!tpool->should_quit && !ALOAD(tpool->qsize) && !retire) {
+			retire = idle_wait(tpool, tdata);
+		}
+		ADEC(tpool->nidle);
+		if(retire) {
+			retire_worker(tpool, tdata);
+		}
+		pthread_mutex_unlock(&tpool->workq_mutex);
+
+		if(t0) {
+			SADD(tdata->stats.idle_us, get_usec() - t0);
+			SADD(tdata->stats.wakeups, 1);
+		}
+		if(retire) break;
+	}
+
+	return 0;
+}
+
+/* start a worker in the first free slot. Call with workq_mutex held. */
+static int start_worker(struct thread_pool *tpool)
+{
+	int idx = tpool->nlive;
+	struct thread_data *td = tpool->tdata + idx;
+
+	if(idx >= tpool->num_threads) {
+		return -1;
+	}
+	if(td->state == SLOT_EXITED) {
+		/* it has already released the mutex, and is on its way out */
+		pthread_join(tpool->threads[idx], 0);
+		td->state = SLOT_UNUSED;
+	}
+
+	if(pthread_create(tpool->threads + idx, 0, tpool->tfunc, td) != 0) {
+		return -1;
+	}
+	td->state = SLOT_RUNNING;
+	__atomic_store_n(&tpool->nlive, idx + 1, __ATOMIC_SEQ_CST);
+
+	SADD(td->stats.spawned, 1);
+	SSTORE(td->stats.threads, 1);
+	return 0;
+}
+
+/* sleep on workq_condvar until woken up. Call with workq_mutex held.
+ * In elastic mode, returns 1 if the worker has been idle long enough to exit.
+ * Only the last running worker exits, which keeps the running workers in the
+ * first nlive slots.
+ */
+static int idle_wait(struct thread_pool *tpool, struct thread_data *tdata)
+{
+	struct timespec ts;
+
+	if(!tpool->elastic) {
+		pthread_cond_wait(&tpool->workq_condvar, &tpool->workq_mutex);
+		return 0;
+	}
+
+	abs_timeout(&ts, tpool->idle_ms);
+	if(pthread_cond_timedwait(&tpool->workq_condvar, &tpool->workq_mutex, &ts) != ETIMEDOUT) {
+		return 0;
+	}
+	return !tpool->should_quit && !ALOAD(tpool->qsize) &&
+		tdata->id == tpool->nlive - 1 && tpool->nlive > tpool->min_threads;
+}
+
+/* call with workq_mutex held, and return from the thread function after
+ * releasing it. The slot is joined when it's reused, or by tpool_destroy.
+ */
+static void retire_worker(struct thread_pool *tpool, struct thread_data *tdata)
+{
+	tdata->state = SLOT_EXITED;
+	__atomic_store_n(&tpool->nlive, tdata->id, __ATOMIC_SEQ_CST);
+
+	SADD(tdata->stats.retired, 1);
+	SSTORE(tdata->stats.threads, 0);
+}
+
+/* returns how long (in usec) the oldest queued job has been waiting. Call
+ * with workq_mutex held.
+ */
+static long oldest_wait(struct thread_pool *tpool)
+{
+	int i, j;
+	unsigned long long now, oldest = 0;
+	struct work_item *job;
+
+	for(i=0; i<TPOOL_NUM_PRIO; i++) {
+		if((job = tpool->workq[i]) && job->tenq && (!oldest || job->tenq < oldest)) {
+			oldest = job->tenq;
+		}
+	}
+	if(tpool->flags & TPOOL_WORK_STEALING) {
+		for(i=0; i<tpool->num_threads; i++) {
+			for(j=0; j<TPOOL_NUM_PRIO; j++) {
+				struct work_deque *dq = tpool->tdata[i].dq + j;
+				if(!__atomic_load_n(&dq->size, __ATOMIC_RELAXED)) continue;
+
+				/* the tail is the oldest end of a deque */
+				pthread_mutex_lock(&dq->lock);
+				if((job = dq->tail) && job->tenq && (!oldest || job->tenq < oldest)) {
+					oldest = job->tenq;
+				}
+				pthread_mutex_unlock(&dq->lock);
+			}
+		}
+	}
+
+	if(!oldest || (now = get_usec()) <= oldest) {
+		return 0;
+	}
+	return (long)(now - oldest);
+}
+
+/* elastic mode supervisor: sleeps until jobs are queued, and then checks
+ * every queue_wait_ms whether any job has been left waiting for longer than
+ * that, in which case it starts another worker. That happens when all
+ * workers are busy, possibly blocked on I/O, rather than using the CPU.
+ */
+static void *supervisor_func(void *args)
+{
+	struct thread_pool *tpool = args;
+	struct timespec ts;
+
+	pthread_mutex_lock(&tpool->workq_mutex);
+	while(!tpool->should_quit) {
+		/* set the flag before checking qsize, and enqueue checks the flag after
+		 * incrementing qsize, so a wakeup can't be lost.
+		 */
+		__atomic_store_n(&tpool->sup_sleeping, 1, __ATOMIC_SEQ_CST);
+		if(!ALOAD(tpool->qsize)) {
+			pthread_cond_wait(&tpool->sup_condvar, &tpool->workq_mutex);
+			continue;
+		}
+		__atomic_store_n(&tpool->sup_sleeping, 0, __ATOMIC_SEQ_CST);
+
+		if(tpool->nlive < tpool->num_threads && !ALOAD(tpool->nidle) &&
+				oldest_wait(tpool) >= tpool->queue_wait_ms * 1000) {
+			start_worker(tpool);
+		}
+
+		abs_timeout(&ts, tpool->queue_wait_ms);
+		pthread_cond_timedwait(&tpool->sup_condvar, &tpool->workq_mutex, &ts);
+	}
+	pthread_mutex_unlock(&tpool->workq_mutex);
+	return 0;
+}
+
+static void wake_supervisor(struct thread_pool *tpool)
+{
+	if(tpool->elastic && ALOAD(tpool->sup_sleeping)) {
+		pthread_mutex_lock(&tpool->workq_mutex);
+		if(tpool->sup_sleeping) {
+			__atomic_store_n(&tpool->sup_sleeping, 0, __ATOMIC_SEQ_CST);
+			pthread_cond_signal(&tpool->sup_condvar);
+		}
+		pthread_mutex_unlock(&tpool->workq_mutex);
+	}
+}
+
+/* absolute time msec milliseconds from now, for pthread_cond_timedwait */
+static void abs_timeout(struct timespec *ts, long msec)
+{
+#if defined(WIN32) || defined(__WIN32__)
+	timespec_get(ts, TIME_UTC);
+#else
+	clock_gettime(CLOCK_REALTIME, ts);
+#endif
+	ts->tv_sec += msec / 1000;
+	ts->tv_nsec += (msec % 1000) * 1000000;
+	if(ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+
+struct tpool_group *tpool_group_create(struct thread_pool *tpool)
+{
+	struct tpool_group *grp;
+
+	if(!(grp = calloc(1, sizeof *grp))) {
+		return 0;
+	}
+	grp->pool = tpool;
+	grp->prio = TPOOL_PRIO_NORMAL;
+	pthread_mutex_init(&grp->mutex, 0);
+	pthread_cond_init(&grp->cond, 0);
+	return grp;
+}
+
+void tpool_group_destroy(struct tpool_group *grp)
+{
+	if(!grp) return;
+
+	/* wait for the last completion to let go of the mutex */
+	pthread_mutex_lock(&grp->mutex);
+	pthread_mutex_unlock(&grp->mutex);
+
+	pthread_mutex_destroy(&grp->mutex);
+	pthread_cond_destroy(&grp->cond);
+	free(grp);
+}
+
+void tpool_group_set_priority(struct tpool_group *grp, int prio)
+{
+	grp->prio = prio < 0 ? 0 : (prio >= TPOOL_NUM_PRIO ? TPOOL_NUM_PRIO - 1 : prio);
+}
+
+int tpool_group_enqueue(struct tpool_group *grp, void *data,
+		tpool_callback work_func, tpool_callback done_func)
+{
+	return enqueue(grp->pool, grp, grp->prio, data, work_func, done_func);
+}
+
+int tpool_group_enqueue_many(struct tpool_group *grp, int n, void **data,
+		tpool_callback work_func, tpool_callback done_func)
+{
+	return enqueue_many(grp->pool, grp, grp->prio, n, data, work_func, done_func);
+}
+
+int tpool_group_pending(struct tpool_group *grp)
+{
+	return ALOAD(grp->pending);
+}
+
+void tpool_group_wait(struct tpool_group *grp)
+{
+	int nenq;
+
+	while(ALOAD(grp->pending) > 0) {
+		nenq = ALOAD(grp->nenq);
+
+		/* help out instead of blocking while there's anything queued */
+		if(run_one(grp->pool)) continue;
+
+		/* nothing for us to run, sleep until the group is done, or until more
+		 * jobs are added to it which we could run.
+		 */
+		pthread_mutex_lock(&grp->mutex);
+		AINC(grp->nwaiters);
+		while(ALOAD(grp->pending) > 0 && ALOAD(grp->nenq) == nenq) {
+			pthread_cond_wait(&grp->cond, &grp->mutex);
+		}
+		ADEC(grp->nwaiters);
+		pthread_mutex_unlock(&grp->mutex);
+	}
+
+	/* the last job brings pending to 0 with the mutex held; once we get the
+	 * mutex it's done touching the group, and the caller may destroy it.
+	 */
+	pthread_mutex_lock(&grp->mutex);
+	pthread_mutex_unlock(&grp->mutex);
+}
+
+/* called after jobs are added to a group, wakes up its waiters to help out */
+static void group_notify(struct tpool_group *grp)
+{
+	AINC(grp->nenq);
+	if(ALOAD(grp->nwaiters)) {
+		pthread_mutex_lock(&grp->mutex);
+		pthread_cond_broadcast(&grp->cond);
+		pthread_mutex_unlock(&grp->mutex);
+	}
+}
+
+static void group_job_done(struct tpool_group *grp)
+{
+	int n = ALOAD(grp->pending);
+
+	/* all but the last completion just decrement pending */
+	while(n > 1) {
+		if(__atomic_compare_exchange_n(&grp->pending, &n, n - 1, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&grp->mutex);
+	if(ADEC(grp->pending) == 0) {
+		pthread_cond_broadcast(&grp->cond);
+	}
+	pthread_mutex_unlock(&grp->mutex);
+}
+
+struct tpool_strand *tpool_strand_create(struct thread_pool *tpool)
+{
+	struct tpool_strand *st;
+
+	if(!(st = calloc(1, sizeof *st))) {
+		return 0;
+	}
+	st->pool = tpool;
+	pthread_mutex_init(&st->mutex, 0);
+	pthread_cond_init(&st->cond, 0);
+	return st;
+}
+
+void tpool_strand_destroy(struct tpool_strand *st)
+{
+	if(!st) return;
+
+	/* the runner only lets go of the strand when it clears scheduled, which
+	 * happens after the last job has completed.
+	 */
+	pthread_mutex_lock(&st->mutex);
+	while(st->scheduled) {
+		pthread_cond_wait(&st->cond, &st->mutex);
+	}
+	pthread_mutex_unlock(&st->mutex);
+
+	pthread_mutex_destroy(&st->mutex);
+	pthread_cond_destroy(&st->cond);
+	free(st);
+}
+
+int tpool_strand_post(struct tpool_strand *st, void *data,
+		tpool_callback work_func, tpool_callback done_func)
+{
+	int sched;
+	struct work_item *job;
+
+	if(!(job = alloc_work_item())) {
+		return -1;
+	}
+	job->prio = TPOOL_PRIO_NORMAL;
+	job->work = work_func;
+	job->done = done_func;
+	job->data = data;
+	job->grp = 0;
+	job->block = 0;
+	job->tenq = 0;
+	job->next = 0;
+
+	AINC(st->npending);
+
+	pthread_mutex_lock(&st->mutex);
+	if(st->head) {
+		st->tail->next = job;
+		st->tail = job;
+	} else {
+		st->head = st->tail = job;
+	}
+	if((sched = !st->scheduled)) {
+		st->scheduled = 1;
+	}
+	pthread_mutex_unlock(&st->mutex);
+
+	/* the strand was idle, queue up a runner. If that fails, run the strand
+	 * on this thread instead: jobs posted by others since we set scheduled are
+	 * already counted on to run, so backing out isn't an option.
+	 */
+	if(sched && enqueue(st->pool, 0, TPOOL_PRIO_NORMAL, st, strand_run, 0) == -1) {
+		strand_run(st);
+	}
+	return 0;
+}
+
+int tpool_strand_pending(struct tpool_strand *st)
+{
+	return ALOAD(st->npending);
+}
+
+/* called with the strand mutex held, and releases it. Nothing may touch the
+ * strand after this, since tpool_strand_destroy might free it right away.
+ */
+static void strand_idle(struct tpool_strand *st)
+{
+	st->scheduled = 0;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->mutex);
+}
+
+/* the strand runner is a regular pool job, which runs the strand jobs in
+ * order. There's at most one runner per strand queued or running at any
+ * time, which is what serializes them.
+ */
+static void strand_run(void *cls)
+{
+	int i;
+	struct tpool_strand *st = cls;
+	struct work_item *job;
+
+	for(;;) {
+		for(i=0; i<STRAND_BATCH; i++) {
+			pthread_mutex_lock(&st->mutex);
+			if(!(job = st->head)) {
+				strand_idle(st);
+				return;
+			}
+			if(!(st->head = job->next)) {
+				st->tail = 0;
+			}
+			pthread_mutex_unlock(&st->mutex);
+
+			job->work(job->data);
+			if(job->done) {
+				job->done(job->data);
+			}
+			free_work_item(job);
+			ADEC(st->npending);
+		}
+
+		/* requeue ourselves for the rest, to give other jobs a chance to run.
+		 * scheduled stays set, so nobody else can queue another runner.
+		 */
+		pthread_mutex_lock(&st->mutex);
+		if(!st->head) {
+			strand_idle(st);
+			return;
+		}
+		pthread_mutex_unlock(&st->mutex);
+
+		if(enqueue(st->pool, 0, TPOOL_PRIO_NORMAL, st, strand_run, 0) != -1) {
+			return;
+		}
+		/* couldn't requeue, just keep going on this thread */
+	}
+}
+
+/* called by tpool_clear for a strand whose runner was dropped from the queue */
+static void strand_discard(struct tpool_strand *st)
+{
+	struct work_item *job;
+
+	pthread_mutex_lock(&st->mutex);
+	while(st->head) {
+		job = st->head;
+		st->head = job->next;
+		free_work_item(job);
+		ADEC(st->npending);
+	}
+	st->tail = 0;
+	strand_idle(st);
+}
+
+int tpool_num_threads(struct thread_pool *tpool)
+{
+	return ALOAD(tpool->nlive);
+}
+
+int tpool_max_threads(struct thread_pool *tpool)
+{
+	return tpool->num_threads;
+}
+
+void tpool_enable_stats(struct thread_pool *tpool, int enable)
+{
+	SSTORE(tpool->stats_enabled, enable ? 1 : 0);
+}
+
+static void reset_stats(struct tpool_stats *st)
+{
+	int i;
+
+	SSTORE(st->jobs, 0);
+	SSTORE(st->steals, 0);
+	SSTORE(st->wakeups, 0);
+	SSTORE(st->busy_us, 0);
+	SSTORE(st->idle_us, 0);
+	SSTORE(st->spawned, 0);
+	SSTORE(st->retired, 0);
+	for(i=0; i<TPOOL_HIST_BINS; i++) {
+		SSTORE(st->wait_hist[i], 0);
+		SSTORE(st->exec_hist[i], 0);
+	}
+}
+
+void tpool_reset_stats(struct thread_pool *tpool)
+{
+	int i;
+
+	for(i=0; i<tpool->num_threads; i++) {
+		reset_stats(&tpool->tdata[i].stats);
+	}
+	reset_stats(&tpool->ext_stats);
+}
+
+/* accumulate a snapshot of src into dest */
+static void merge_stats(struct tpool_stats *dest, struct tpool_stats *src)
+{
+	int i;
+
+	dest->jobs += SLOAD(src->jobs);
+	dest->steals += SLOAD(src->steals);
+	dest->wakeups += SLOAD(src->wakeups);
+	dest->busy_us += SLOAD(src->busy_us);
+	dest->idle_us += SLOAD(src->idle_us);
+	dest->threads += SLOAD(src->threads);
+	dest->spawned += SLOAD(src->spawned);
+	dest->retired += SLOAD(src->retired);
+	for(i=0; i<TPOOL_HIST_BINS; i++) {
+		dest->wait_hist[i] += SLOAD(src->wait_hist[i]);
+		dest->exec_hist[i] += SLOAD(src->exec_hist[i]);
+	}
+}
+
+void tpool_get_stats(struct thread_pool *tpool, struct tpool_stats *total,
+		struct tpool_stats *per_thread)
+{
+	int i;
+
+	if(total) {
+		memset(total, 0, sizeof *total);
+		merge_stats(total, &tpool->ext_stats);
+	}
+	for(i=0; i<tpool->num_threads; i++) {
+		if(per_thread) {
+			memset(per_thread + i, 0, sizeof *per_thread);
+			merge_stats(per_thread + i, &tpool->tdata[i].stats);
+		}
+		if(total) {
+			merge_stats(total, &tpool->tdata[i].stats);
+		}
+	}
+}
+
+static void hist_add(unsigned long *hist, unsigned long long usec)
+{
+	int bin = 0;
+
+	while(usec && bin < TPOOL_HIST_BINS - 1) {
+		usec >>= 1;
+		bin++;
+	}
+	SADD(hist[bin], 1);
+}
+
+/* monotonic clock for the statistics */
+static unsigned long long get_usec(void)
+{
+#if defined(WIN32) || defined(__WIN32__)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER cnt;
+
+	if(!freq.QuadPart) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&cnt);
+	return (unsigned long long)cnt.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+int tpool_thread_id(struct thread_pool *tpool)
+{
+	struct thread_data *tdata = pthread_getspecific(tpool->idkey);
+	if(!tdata || tdata->pool != tpool) {
+		return -1;
+	}
+	return tdata->id;
+}
+
+
+/* The following highly platform-specific code detects the number
+ * of processors available in the system. It's used by the thread pool
+ * to autodetect how many threads to spawn.
+ * Currently works on: Linux, BSD, Darwin, and Windows.
+ */
+int tpool_num_processors(void)
+{
+#if defined(unix) || defined(__unix__)
 # if defined(__bsd__)
 	/* BSD systems provide the num.processors through sysctl */
 	int num, mib[] = {CTL_HW, HW_NCPU};
@@ -453,38 +1861,363 @@ int tpool_num_processors(void)
 #endif
 }
 
-#define MAX_WPOOL_SIZE	64
-static pthread_mutex_t wpool_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct work_item *wpool;
-static int wpool_size;
+/* group the pinned workers by NUMA node, and work out the stealing order of
+ * each worker: the workers on the same node first, then everyone else, both
+ * starting right after the worker itself, so that thieves don't all converge
+ * on the same victim.
+ */
+static void init_numa(struct thread_pool *tpool)
+{
+	int i, j, k, n = tpool->num_threads;
+	int max_node = -1, nnodes = 0;
+	struct thread_data *td;
+
+	for(i=0; i<n; i++) {
+		td = tpool->tdata + i;
+		td->victims = tpool->victim_buf + i * n;
+
+		k = 0;
+		for(j=1; j<n; j++) {
+			if(tpool->tdata[(i + j) % n].node == td->node) {
+				td->victims[k++] = (i + j) % n;
+			}
+		}
+		for(j=1; j<n; j++) {
+			if(tpool->tdata[(i + j) % n].node != td->node) {
+				td->victims[k++] = (i + j) % n;
+			}
+		}
+
+		if(td->node > max_node) max_node = td->node;
+	}
+
+	if(max_node < 1) return;	/* all on one node, or unknown */
+
+	if(!(tpool->nodes = calloc(max_node + 1, sizeof *tpool->nodes)) ||
+			!(tpool->node_workers = malloc(n * sizeof *tpool->node_workers))) {
+		free(tpool->nodes);
+		tpool->nodes = 0;
+		return;
+	}
+	tpool->num_nodes = max_node + 1;
+
+	for(i=0; i<n; i++) {
+		if(tpool->tdata[i].node >= 0) {
+			tpool->nodes[tpool->tdata[i].node].count++;
+		}
+	}
+	k = 0;
+	for(i=0; i<tpool->num_nodes; i++) {
+		tpool->nodes[i].workers = tpool->node_workers + k;
+		k += tpool->nodes[i].count;
+		if(tpool->nodes[i].count) nnodes++;
+		tpool->nodes[i].count = 0;
+	}
+	for(i=0; i<n; i++) {
+		struct numa_node *nd;
+		if(tpool->tdata[i].node < 0) continue;
+		nd = tpool->nodes + tpool->tdata[i].node;
+		nd->workers[nd->count++] = i;
+	}
+
+	if(nnodes < 2) {
+		free(tpool->nodes);
+		free(tpool->node_workers);
+		tpool->nodes = 0;
+		tpool->node_workers = 0;
+		tpool->num_nodes = 0;
+	}
+}
+
+static void destroy_affinity(struct thread_pool *tpool)
+{
+	free(tpool->cpus);
+	free(tpool->cpu_node);
+	free(tpool->nodes);
+	free(tpool->node_workers);
+}
+
+#ifdef __linux__
+static int cpu_numa_node(int cpu)
+{
+	int node = -1;
+	char path[64];
+	DIR *dir;
+	struct dirent *ent;
+
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	if(!(dir = opendir(path))) {
+		return -1;
+	}
+	while((ent = readdir(dir))) {
+		if(sscanf(ent->d_name, "node%d", &node) == 1) {
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+static int init_affinity(struct thread_pool *tpool, const int *cpus, int num_cpus)
+{
+	int i, j, max_cpu;
+	cpu_set_t set;
+
+	if(!cpus) {
+		if(sched_getaffinity(0, sizeof set, &set) == -1) {
+			return -1;
+		}
+		num_cpus = CPU_COUNT(&set);
+	}
+	if(num_cpus <= 0) {
+		return -1;
+	}
+
+	if(!(tpool->cpus = malloc(num_cpus * sizeof *tpool->cpus))) {
+		return -1;
+	}
+	tpool->num_cpus = num_cpus;
+	if(cpus) {
+		memcpy(tpool->cpus, cpus, num_cpus * sizeof *cpus);
+	} else {
+		for(i=0, j=0; i<CPU_SETSIZE && j<num_cpus; i++) {
+			if(CPU_ISSET(i, &set)) {
+				tpool->cpus[j++] = i;
+			}
+		}
+	}
+
+	/* map every CPU to its node, not just the ones in the set, since threads
+	 * enqueueing jobs might be running anywhere.
+	 */
+	max_cpu = sysconf(_SC_NPROCESSORS_CONF) - 1;
+	for(i=0; i<num_cpus; i++) {
+		if(tpool->cpus[i] < 0 || tpool->cpus[i] >= CPU_SETSIZE) {
+			return -1;
+		}
+		if(tpool->cpus[i] > max_cpu) max_cpu = tpool->cpus[i];
+	}
+	if(!(tpool->cpu_node = malloc((max_cpu + 1) * sizeof *tpool->cpu_node))) {
+		return -1;
+	}
+	tpool->cpu_node_size = max_cpu + 1;
+	for(i=0; i<=max_cpu; i++) {
+		tpool->cpu_node[i] = cpu_numa_node(i);
+	}
+	return 0;
+}
+
+/* called by each worker when it starts, before it touches any memory */
+static void set_thread_affinity(struct thread_data *tdata)
+{
+	int i;
+	cpu_set_t set;
+	struct thread_pool *tpool = tdata->pool;
+
+	if(!tpool->cpus) return;
+
+	CPU_ZERO(&set);
+	if(tdata->cpu >= 0) {
+		CPU_SET(tdata->cpu, &set);
+	} else {
+		for(i=0; i<tpool->num_cpus; i++) {
+			CPU_SET(tpool->cpus[i], &set);
+		}
+	}
+	pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+}
+
+static struct numa_node *caller_node(struct thread_pool *tpool)
+{
+	int cpu, node;
+
+	if(!tpool->nodes) return 0;
+
+	if((cpu = sched_getcpu()) < 0 || cpu >= tpool->cpu_node_size) {
+		return 0;
+	}
+	if((node = tpool->cpu_node[cpu]) < 0 || node >= tpool->num_nodes) {
+		return 0;
+	}
+	return tpool->nodes[node].count ? tpool->nodes + node : 0;
+}
+
+#else	/* !__linux__ */
+static int init_affinity(struct thread_pool *tpool, const int *cpus, int num_cpus)
+{
+	return 0;
+}
+
+static void set_thread_affinity(struct thread_data *tdata)
+{
+}
+
+static struct numa_node *caller_node(struct thread_pool *tpool)
+{
+	return 0;
+}
+#endif	/* __linux__ */
+
+/* work item allocator. Every thread keeps a small cache of free items, so
+ * that enqueueing and completing jobs doesn't touch shared state most of the
+ * time. A full cache hands a batch of items over to a bounded global set of
+ * batch slots, which empty caches refill from. Items which don't fit in either
+ * are freed. Batch slots are claimed with a CAS and emptied with an atomic
+ * exchange, so there's no lock, and no ABA problem.
+ */
+#define TCACHE_SIZE		64
+#define TCACHE_BATCH	(TCACHE_SIZE / 2)
+#define WPOOL_SLOTS		64
+
+struct item_cache {
+	struct work_item *head;
+	int size;
+	int registered;		/* set once the cache is flushed on thread exit */
+};
+
+static __thread struct item_cache tcache;
+
+static struct work_item *wpool[WPOOL_SLOTS];	/* lists of TCACHE_BATCH items */
+static int wpool_nbatches;
+static pthread_once_t wpool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t wpool_key;
+
+static int put_batch(struct work_item *batch)
+{
+	int i;
+	struct work_item *expected;
+
+	for(i=0; i<WPOOL_SLOTS; i++) {
+		expected = 0;
+		if(__atomic_compare_exchange_n(wpool + i, &expected, batch, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			AINC(wpool_nbatches);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static struct work_item *take_batch(void)
+{
+	int i;
+	struct work_item *batch;
+
+	if(ALOAD(wpool_nbatches) <= 0) {
+		return 0;
+	}
+	for(i=0; i<WPOOL_SLOTS; i++) {
+		if(__atomic_load_n(wpool + i, __ATOMIC_RELAXED) &&
+				(batch = __atomic_exchange_n(wpool + i, 0, __ATOMIC_ACQUIRE))) {
+			ADEC(wpool_nbatches);
+			return batch;
+		}
+	}
+	return 0;
+}
+
+/* detaches the first TCACHE_BATCH items of the cache, which must have that
+ * many, and returns them as a list.
+ */
+static struct work_item *split_batch(struct item_cache *tc)
+{
+	int i;
+	struct work_item *batch, *last;
+
+	batch = last = tc->head;
+	for(i=1; i<TCACHE_BATCH; i++) {
+		last = last->next;
+	}
+	tc->head = last->next;
+	last->next = 0;
+	tc->size -= TCACHE_BATCH;
+	return batch;
+}
+
+static void free_list(struct work_item *w)
+{
+	struct work_item *next;
+
+	while(w) {
+		next = w->next;
+		free(w);
+		w = next;
+	}
+}
+
+/* thread exit: whole batches go to the global pool, the rest are freed */
+static void flush_tcache(void *cls)
+{
+	struct item_cache *tc = cls;
+	struct work_item *batch;
+
+	while(tc->size >= TCACHE_BATCH) {
+		batch = split_batch(tc);
+		if(put_batch(batch) == -1) {
+			free_list(batch);
+		}
+	}
+	free_list(tc->head);
+	tc->head = 0;
+	tc->size = 0;
+}
+
+static void init_wpool(void)
+{
+	pthread_key_create(&wpool_key, flush_tcache);
+}
+
+static struct item_cache *get_tcache(void)
+{
+	struct item_cache *tc = &tcache;
+
+	if(!tc->registered) {
+		pthread_once(&wpool_once, init_wpool);
+		pthread_setspecific(wpool_key, tc);
+		tc->registered = 1;
+	}
+	return tc;
+}
 
-/* work item allocator */
 static struct work_item *alloc_work_item(void)
 {
 	struct work_item *w;
+	struct item_cache *tc = get_tcache();
 
-	pthread_mutex_lock(&wpool_lock);
-	if(!wpool) {
-		pthread_mutex_unlock(&wpool_lock);
-		return malloc(sizeof(struct work_item));
+	if(!tc->head) {
+		if(!(tc->head = take_batch())) {
+			return malloc(sizeof(struct work_item));
+		}
+		tc->size = TCACHE_BATCH;
 	}
 
-	w = wpool;
-	wpool = wpool->next;
-	--wpool_size;
-	pthread_mutex_unlock(&wpool_lock);
+	w = tc->head;
+	tc->head = w->next;
+	tc->size--;
 	return w;
 }
 
 static void free_work_item(struct work_item *w)
 {
-	pthread_mutex_lock(&wpool_lock);
-	if(wpool_size >= MAX_WPOOL_SIZE) {
-		free(w);
-	} else {
-		w->next = wpool;
-		wpool = w;
-		++wpool_size;
+	struct work_item *batch;
+	struct item_cache *tc;
+
+	if(w->block) {
+		if(ADEC(w->block->nref) == 0) {
+			free(w->block);
+		}
+		return;
 	}
-	pthread_mutex_unlock(&wpool_lock);
+
+	tc = get_tcache();
+	if(tc->size >= TCACHE_SIZE) {
+		batch = split_batch(tc);
+		if(put_batch(batch) == -1) {
+			free_list(batch);
+		}
+	}
+
+	w->next = tc->head;
+	tc->head = w;
+	tc->size++;
 }
@@ -6,6 +6,8 @@
 #define THREADPOOL_H_
 
 struct thread_pool;
+struct tpool_group;
+struct tpool_strand;
 
 /* type of the function accepted as work or completion callback */
 typedef void (*tpool_callback)(void*);
@@ -14,8 +16,55 @@ typedef void (*tpool_callback)(void*);
 extern "C" {
 #endif
 
+/* flags for tpool_create_flags */
+enum {
+	/* each worker gets its own job deque. Jobs enqueued by a worker go to the
+	 * front of its own deque, jobs enqueued by other threads are spread across
+	 * the workers, and idle workers steal from the back of the others' deques.
+	 * Jobs are not guaranteed to start in FIFO order in this mode.
+	 */
+	TPOOL_WORK_STEALING = 1,
+	/* pin each worker thread to a single CPU, assigning the CPUs of the pool's
+	 * CPU set in order. In work-stealing mode, idle workers steal from workers
+	 * on the same NUMA node before going to other nodes, and jobs enqueued by
+	 * non-worker threads go to the workers on the caller's node.
+	 * Currently only implemented on Linux, ignored elsewhere.
+	 */
+	TPOOL_PIN_THREADS = 2
+};
+
+/* job priority levels. Workers always pick the highest priority queued job,
+ * except that a lower priority level which has been passed over too many
+ * times in a row gets to run its next job, so it can't starve completely.
+ */
+enum {
+	TPOOL_PRIO_HIGH,
+	TPOOL_PRIO_NORMAL,
+	TPOOL_PRIO_LOW,
+
+	TPOOL_NUM_PRIO
+};
+
 /* if num_threads == 0, auto-detect how many threads to spawn */
 struct thread_pool *tpool_create(int num_threads);
+struct thread_pool *tpool_create_flags(int num_threads, unsigned int flags);
+/* Elastic pools start with min_threads workers, and start more, up to
+ * max_threads, whenever a queued job has been left waiting for longer than
+ * queue_wait_ms, which happens when the workers are blocked on I/O for
+ * instance. Workers which stay idle for longer than idle_ms exit, down to
+ * min_threads. Pass 0 to use the defaults: 1 to tpool_num_processors threads,
+ * 5 ms and 1 sec. The wait calls work the same as with fixed-size pools.
+ */
+struct thread_pool *tpool_create_elastic(int min_threads, int max_threads,
+		unsigned int flags, long queue_wait_ms, long idle_ms);
+/* restrict the pool to a set of CPUs: cpus is an array of num_cpus CPU
+ * numbers. If cpus is null, the CPUs the process is allowed to run on are
+ * used. If num_threads == 0, one thread per CPU in the set is spawned.
+ * Without TPOOL_PIN_THREADS, every worker can run on any CPU of the set.
+ * Linux only: elsewhere it's the same as tpool_create_flags.
+ */
+struct thread_pool *tpool_create_cpus(int num_threads, unsigned int flags,
+		const int *cpus, int num_cpus);
 void tpool_destroy(struct thread_pool *tpool);
 
 /* optional reference counting interface for thread pool sharing */
@@ -33,11 +82,27 @@ void tpool_end_batch(struct thread_pool *tpool);
  */
 int tpool_enqueue(struct thread_pool *tpool, void *data,
 		tpool_callback work_func, tpool_callback done_func);
+/* same as tpool_enqueue with a priority level (TPOOL_PRIO_*). tpool_enqueue
+ * and tpool_enqueue_many use TPOOL_PRIO_NORMAL.
+ */
+int tpool_enqueue_prio(struct thread_pool *tpool, int prio, void *data,
+		tpool_callback work_func, tpool_callback done_func);
+
+/* enqueue n jobs with the same work and done callbacks at once, each one
+ * getting the corresponding element of the data array (or null if data is
+ * null). All work items are allocated in a single block, appended to the
+ * queue in one go, and at most n idle workers are woken up.
+ */
+int tpool_enqueue_many(struct thread_pool *tpool, int n, void **data,
+		tpool_callback work_func, tpool_callback done_func);
+
 /* clear the work queue. does not cancel any currently running jobs */
 void tpool_clear(struct thread_pool *tpool);
 
 /* returns the number of queued work items */
 int tpool_queued_jobs(struct thread_pool *tpool);
+/* returns the number of queued work items of a specific priority level */
+int tpool_queued_jobs_prio(struct thread_pool *tpool, int prio);
 /* returns the number of active (working) threads */
 int tpool_active_jobs(struct thread_pool *tpool);
 /* returns the number of pending jobs, both in queue and active */
@@ -61,6 +126,20 @@ long tpool_timedwait(struct thread_pool *tpool, long timeout);
  */
 int tpool_get_wait_fd(struct thread_pool *tpool);
 
+/* return a file descriptor which becomes readable when jobs have completed,
+ * for use with poll/select/epoll. Unlike tpool_get_wait_fd, completions are
+ * coalesced: the descriptor is signalled once, and stays readable until
+ * tpool_completed_jobs is called, so that busy pools don't cost a syscall per
+ * job. Don't read from it directly.
+ * It's an eventfd on Linux, and a pipe on other UNIX systems. Returns -1 on
+ * Windows.
+ */
+int tpool_get_event_fd(struct thread_pool *tpool);
+/* returns the number of jobs completed since the last call (counting starts
+ * with the tpool_get_event_fd call), and re-arms the event fd.
+ */
+int tpool_completed_jobs(struct thread_pool *tpool);
+
 /* return an auto-resetting Event HANDLE which can be used to wait for
  * pending job completion events.
  *
@@ -68,10 +147,94 @@ int tpool_get_wait_fd(struct thread_pool *tpool);
  */
 void *tpool_get_wait_handle(struct thread_pool *tpool);
 
+/* Job groups allow waiting for a specific set of jobs, instead of every job in
+ * the pool, which is useful when multiple subsystems share the same pool.
+ * Groups are bound to a pool at creation, and can be reused after each wait.
+ * Don't destroy a group while it has pending jobs.
+ */
+struct tpool_group *tpool_group_create(struct thread_pool *tpool);
+void tpool_group_destroy(struct tpool_group *grp);
+
+/* set the priority of jobs subsequently enqueued to the group (default:
+ * TPOOL_PRIO_NORMAL).
+ */
+void tpool_group_set_priority(struct tpool_group *grp, int prio);
+
+/* same as tpool_enqueue, but the job is also counted in the group */
+int tpool_group_enqueue(struct tpool_group *grp, void *data,
+		tpool_callback work_func, tpool_callback done_func);
+int tpool_group_enqueue_many(struct tpool_group *grp, int n, void **data,
+		tpool_callback work_func, tpool_callback done_func);
+/* returns the number of group jobs which haven't completed yet */
+int tpool_group_pending(struct tpool_group *grp);
+/* wait for all jobs in the group to be completed. While waiting, the calling
+ * thread runs queued jobs (of any group), so it's safe to wait on a group
+ * from inside a job without stalling the pool.
+ */
+void tpool_group_wait(struct tpool_group *grp);
+
+/* Strands run the jobs posted to them one at a time, in the order they were
+ * posted, on any of the pool's worker threads. Jobs in different strands (or
+ * posted directly to the pool) still run in parallel. This serializes access
+ * to a single resource without holding a lock while the jobs run, and without
+ * dedicating a thread to it. An idle strand isn't queued anywhere, and costs
+ * nothing but its memory.
+ * tpool_strand_destroy waits for the jobs already posted to the strand to
+ * complete, so don't call it from one of them, and don't post more jobs while
+ * it's waiting. tpool_clear also drops the jobs waiting in a strand, but only
+ * if none of the strand's jobs is running at the time: a strand which is busy
+ * running one goes on to run the rest after it.
+ */
+struct tpool_strand *tpool_strand_create(struct thread_pool *tpool);
+void tpool_strand_destroy(struct tpool_strand *st);
+
+int tpool_strand_post(struct tpool_strand *st, void *data,
+		tpool_callback work_func, tpool_callback done_func);
+/* returns the number of strand jobs which haven't completed yet */
+int tpool_strand_pending(struct tpool_strand *st);
+
 /* When called by a work/done callback, it returns the thread number executing
  * it. From the main thread it returns -1.
  */
 int tpool_thread_id(struct thread_pool *tpool);
+/* returns the number of running worker threads in the pool */
+int tpool_num_threads(struct thread_pool *tpool);
+/* returns the maximum number of worker threads, which for fixed-size pools is
+ * the same as tpool_num_threads.
+ */
+int tpool_max_threads(struct thread_pool *tpool);
+
+/* Statistics are disabled by default. When enabled, every worker thread
+ * updates its own set of counters, and they're only combined when read.
+ * The latency histograms have log2 microsecond bins: bin 0 counts durations
+ * under 1us, bin i counts durations in [2^(i-1), 2^i) us, and the last bin
+ * counts everything longer.
+ */
+#define TPOOL_HIST_BINS		24
+
+struct tpool_stats {
+	unsigned long jobs;			/* jobs executed */
+	unsigned long steals;		/* jobs stolen from other workers' deques */
+	unsigned long wakeups;		/* times woken up after sleeping for work */
+	unsigned long long busy_us;	/* time spent running jobs */
+	unsigned long long idle_us;	/* time spent sleeping for work */
+	/* worker threads running, started and exited (always recorded, and only
+	 * interesting for elastic pools). Per thread, threads is 0 or 1.
+	 */
+	int threads;
+	unsigned long spawned, retired;
+	unsigned long wait_hist[TPOOL_HIST_BINS];	/* enqueue to start latency */
+	unsigned long exec_hist[TPOOL_HIST_BINS];	/* job execution time */
+};
+
+void tpool_enable_stats(struct thread_pool *tpool, int enable);
+void tpool_reset_stats(struct thread_pool *tpool);
+/* total receives the combined statistics of all threads, including jobs run
+ * by non-worker threads while helping out in tpool_group_wait. per_thread, if
+ * not null, must have room for tpool_max_threads entries. Either can be null.
+ */
+void tpool_get_stats(struct thread_pool *tpool, struct tpool_stats *total,
+		struct tpool_stats *per_thread);
 
 
 /* returns the number of processors on the system.